@@ -0,0 +1,243 @@
+// Microbenchmarks for the inference hot paths exposed by the binding.
+//
+// Every model found under --models_dir is loaded once and benchmarked for
+// pc_to_mel, encode, a single decoder step, full and full_parallel, for each
+// thread count given in --threads. Use --benchmark_format=json (or
+// --benchmark_out=<file> --benchmark_out_format=json) to get a machine
+// readable report that can be diffed between CPUs and releases.
+//
+// The iterations repeat the same window on one state. encode() and full()
+// never reuse the encoder output of an earlier call, and the contexts have
+// no transcription cache, so every iteration does the full amount of work.
+#include "benchmark/benchmark.h"
+#include "examples/common.h"
+#include "src/whispercpp/context.h"
+
+#include <dirent.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+struct BenchmarkFlags {
+    std::string models_dir = "tests/models";
+    std::string audio = "samples/jfk.wav";
+    std::vector<int> threads;
+    std::vector<int> processors = {2, 4};
+};
+
+struct LoadedModel {
+    std::string name;
+    Context context;
+};
+
+std::vector<int> parse_int_list(const char *value) {
+    std::vector<int> out;
+    std::string token;
+    for (const char *p = value;; ++p) {
+        if (*p == ',' || *p == '\0') {
+            if (!token.empty()) {
+                out.push_back(std::atoi(token.c_str()));
+            }
+            token.clear();
+            if (*p == '\0') {
+                break;
+            }
+        } else {
+            token.push_back(*p);
+        }
+    }
+    return out;
+}
+
+// Parse the flags left over after benchmark::Initialize consumed its own.
+BenchmarkFlags parse_flags(int argc, char **argv) {
+    BenchmarkFlags flags;
+    for (int i = 1; i < argc; ++i) {
+        const char *arg = argv[i];
+        if (strncmp(arg, "--models_dir=", 13) == 0) {
+            flags.models_dir = arg + 13;
+        } else if (strncmp(arg, "--audio=", 8) == 0) {
+            flags.audio = arg + 8;
+        } else if (strncmp(arg, "--threads=", 10) == 0) {
+            flags.threads = parse_int_list(arg + 10);
+        } else if (strncmp(arg, "--processors=", 13) == 0) {
+            flags.processors = parse_int_list(arg + 13);
+        } else {
+            fprintf(stderr, "unknown flag: %s\n", arg);
+            std::exit(1);
+        }
+    }
+    if (flags.threads.empty()) {
+        flags.threads.push_back(
+            std::min(4, (int)std::thread::hardware_concurrency()));
+    }
+    return flags;
+}
+
+std::vector<std::string> list_models(const std::string &dir) {
+    std::vector<std::string> models;
+    DIR *d = opendir(dir.c_str());
+    if (d == nullptr) {
+        fprintf(stderr, "failed to open models directory '%s'\n", dir.c_str());
+        return models;
+    }
+    while (struct dirent *entry = readdir(d)) {
+        std::string name(entry->d_name);
+        if (name.size() > 4 && name.compare(name.size() - 4, 4, ".bin") == 0) {
+            models.push_back(dir + "/" + name);
+        }
+    }
+    closedir(d);
+    std::sort(models.begin(), models.end());
+    return models;
+}
+
+std::string model_name(const std::string &path) {
+    std::string base = path.substr(path.find_last_of('/') + 1);
+    return base.substr(0, base.size() - 4);
+}
+
+Params make_params(int threads) {
+    whisper_sampling_strategy strategy = WHISPER_SAMPLING_GREEDY;
+    Params params = Params::from_enum(&strategy);
+    params.with_print_progress(false)
+        ->with_print_realtime(false)
+        ->with_n_threads(threads);
+    return params;
+}
+
+// Real-time factor: wall time spent per second of input audio.
+benchmark::Counter rtf_counter(double audio_seconds) {
+    return benchmark::Counter(audio_seconds,
+                              benchmark::Counter::kIsIterationInvariantRate |
+                                  benchmark::Counter::kInvert);
+}
+
+void register_benchmarks(LoadedModel *model, std::vector<float> *pcm,
+                         const BenchmarkFlags &flags) {
+    const double audio_seconds = (double)pcm->size() / WHISPER_SAMPLE_RATE;
+    const std::string prefix = model->name + "/";
+
+    for (int threads : flags.threads) {
+        const std::string suffix = "/threads:" + std::to_string(threads);
+
+        benchmark::RegisterBenchmark(
+            (prefix + "pc_to_mel" + suffix).c_str(),
+            [model, pcm, threads](benchmark::State &state) {
+                for (auto _ : state) {
+                    model->context.pc_to_mel(*pcm, threads, false);
+                }
+            })
+            ->Unit(benchmark::kMillisecond)
+            ->UseRealTime();
+
+        benchmark::RegisterBenchmark(
+            (prefix + "encode" + suffix).c_str(),
+            [model, pcm, threads](benchmark::State &state) {
+                model->context.pc_to_mel(*pcm, threads, false);
+                for (auto _ : state) {
+                    // runs the encoder every time, see the note on top
+                    model->context.encode(0, threads);
+                }
+            })
+            ->Unit(benchmark::kMillisecond)
+            ->UseRealTime();
+
+        benchmark::RegisterBenchmark(
+            (prefix + "decode_step" + suffix).c_str(),
+            [model, pcm, threads](benchmark::State &state) {
+                model->context.pc_to_mel(*pcm, threads, false);
+                model->context.encode(0, threads);
+                std::vector<whisper_token> prompt = {
+                    model->context.sot_token()};
+                for (auto _ : state) {
+                    model->context.decode(&prompt, 0, threads);
+                }
+            })
+            ->Unit(benchmark::kMillisecond)
+            ->UseRealTime();
+
+        benchmark::RegisterBenchmark(
+            (prefix + "full" + suffix).c_str(),
+            [model, pcm, threads, audio_seconds](benchmark::State &state) {
+                Params params = make_params(threads);
+                for (auto _ : state) {
+                    model->context.full(params, *pcm);
+                }
+                state.counters["rtf"] = rtf_counter(audio_seconds);
+            })
+            ->Unit(benchmark::kMillisecond)
+            ->UseRealTime();
+
+        for (int processors : flags.processors) {
+            benchmark::RegisterBenchmark(
+                (prefix + "full_parallel" + suffix +
+                 "/processors:" + std::to_string(processors))
+                    .c_str(),
+                [model, pcm, threads, processors,
+                 audio_seconds](benchmark::State &state) {
+                    Params params = make_params(threads);
+                    for (auto _ : state) {
+                        model->context.full_parallel(params, *pcm, processors);
+                    }
+                    state.counters["rtf"] = rtf_counter(audio_seconds);
+                })
+                ->Unit(benchmark::kMillisecond)
+                ->UseRealTime();
+        }
+    }
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    benchmark::Initialize(&argc, argv);
+    BenchmarkFlags flags = parse_flags(argc, argv);
+
+    std::vector<float> pcm;
+    std::vector<std::vector<float>> pcm_stereo;
+    if (!::read_wav(flags.audio, pcm, pcm_stereo, false)) {
+        fprintf(stderr, "failed to load audio '%s'\n", flags.audio.c_str());
+        return 1;
+    }
+
+    std::vector<std::string> paths = list_models(flags.models_dir);
+    if (paths.empty()) {
+        fprintf(stderr, "no models found under '%s'\n",
+                flags.models_dir.c_str());
+        return 1;
+    }
+
+    // NOTE: reserve upfront, the registered benchmarks keep pointers into it.
+    std::vector<LoadedModel> models;
+    models.reserve(paths.size());
+    for (const std::string &path : paths) {
+        models.push_back(
+            {model_name(path), Context::from_file(path.c_str(), false)});
+        benchmark::AddCustomContext("model." + models.back().name, path);
+    }
+    benchmark::AddCustomContext("audio", flags.audio);
+    benchmark::AddCustomContext("audio_seconds",
+                                std::to_string((double)pcm.size() /
+                                               WHISPER_SAMPLE_RATE));
+    benchmark::AddCustomContext("system_info", whisper_print_system_info());
+
+    for (LoadedModel &model : models) {
+        register_benchmarks(&model, &pcm, flags);
+    }
+
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+
+    for (LoadedModel &model : models) {
+        model.context.free();
+    }
+    return 0;
+}
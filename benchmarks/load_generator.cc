@@ -0,0 +1,273 @@
+// Closed-loop load generator for concurrent transcription.
+//
+// A single model is loaded once, and every worker gets its own whisper_state
+// on top of the shared context. Workers pull clips from a weighted mix of
+// clip lengths (built by tiling --audio) and transcribe them back to back for
+// --duration_s seconds. The run is repeated for every worker count in
+// --workers, which gives a scaling curve from one worker up to all cores.
+// Every request starts its clip at a random sample, so no two requests
+// transcribe the same windows and nothing computed for an earlier request
+// can be reused.
+//
+// Results are written to stdout as a JSON array, one object per worker count.
+#include "examples/common.h"
+#include "src/whispercpp/context.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+struct ClipSpec {
+    double seconds;
+    double weight;
+};
+
+struct Flags {
+    std::string model = "tests/models/ggml-tiny.en.bin";
+    std::string audio = "samples/jfk.wav";
+    std::vector<ClipSpec> clip_mix = {{5.0, 0.5}, {15.0, 0.3}, {30.0, 0.2}};
+    std::vector<int> workers;
+    int threads = 1;
+    double duration_s = 30.0;
+    unsigned seed = 42;
+};
+
+struct RunResult {
+    int workers;
+    size_t requests;
+    double audio_seconds;
+    double wall_seconds;
+    double p50_ms;
+    double p95_ms;
+    double p99_ms;
+};
+
+std::vector<int> parse_int_list(const char *value) {
+    std::vector<int> out;
+    const char *p = value;
+    while (*p != '\0') {
+        char *end;
+        const long n = std::strtol(p, &end, 10);
+        if (end == p) {
+            break;
+        }
+        out.push_back((int)n);
+        p = (*end == ',') ? end + 1 : end;
+    }
+    return out;
+}
+
+// --clip_mix=5:0.5,15:0.3,30:0.2 (seconds:weight)
+std::vector<ClipSpec> parse_clip_mix(const char *value) {
+    std::vector<ClipSpec> out;
+    const char *p = value;
+    while (*p != '\0') {
+        char *end;
+        ClipSpec spec;
+        spec.seconds = std::strtod(p, &end);
+        spec.weight = 1.0;
+        if (*end == ':') {
+            spec.weight = std::strtod(end + 1, &end);
+        }
+        out.push_back(spec);
+        if (*end != ',') {
+            break;
+        }
+        p = end + 1;
+    }
+    return out;
+}
+
+Flags parse_flags(int argc, char **argv) {
+    Flags flags;
+    for (int i = 1; i < argc; ++i) {
+        const char *arg = argv[i];
+        if (strncmp(arg, "--model=", 8) == 0) {
+            flags.model = arg + 8;
+        } else if (strncmp(arg, "--audio=", 8) == 0) {
+            flags.audio = arg + 8;
+        } else if (strncmp(arg, "--clip_mix=", 11) == 0) {
+            flags.clip_mix = parse_clip_mix(arg + 11);
+        } else if (strncmp(arg, "--workers=", 10) == 0) {
+            flags.workers = parse_int_list(arg + 10);
+        } else if (strncmp(arg, "--threads=", 10) == 0) {
+            flags.threads = std::max(1, std::atoi(arg + 10));
+        } else if (strncmp(arg, "--duration_s=", 13) == 0) {
+            flags.duration_s = std::atof(arg + 13);
+        } else if (strncmp(arg, "--seed=", 7) == 0) {
+            flags.seed = (unsigned)std::atoi(arg + 7);
+        } else {
+            fprintf(stderr, "unknown flag: %s\n", arg);
+            std::exit(1);
+        }
+    }
+    if (flags.workers.empty()) {
+        // 1, 2, 4, ... up to all cores (always including all cores).
+        const int n_cores = std::max(1u, std::thread::hardware_concurrency());
+        for (int n = 1; n < n_cores; n *= 2) {
+            flags.workers.push_back(n);
+        }
+        flags.workers.push_back(n_cores);
+    }
+    return flags;
+}
+
+// Tile the source audio until it reaches the requested length.
+std::vector<float> make_clip(const std::vector<float> &source, double seconds) {
+    const size_t n_samples = (size_t)(seconds * WHISPER_SAMPLE_RATE);
+    std::vector<float> clip(n_samples);
+    for (size_t i = 0; i < n_samples; ++i) {
+        clip[i] = source[i % source.size()];
+    }
+    return clip;
+}
+
+double percentile(std::vector<double> &sorted, double q) {
+    if (sorted.empty()) {
+        return 0.0;
+    }
+    size_t rank = (size_t)std::ceil(q * sorted.size());
+    rank = std::min(std::max<size_t>(rank, 1), sorted.size());
+    return sorted[rank - 1];
+}
+
+RunResult run(Context &base, const Flags &flags,
+              const std::vector<std::vector<float>> &clips, int n_workers) {
+    std::vector<Context> contexts(n_workers, base);
+    for (Context &ctx : contexts) {
+        ctx.init_state();
+    }
+
+    std::vector<double> weights;
+    for (const ClipSpec &spec : flags.clip_mix) {
+        weights.push_back(spec.weight);
+    }
+
+    std::vector<std::vector<double>> latencies(n_workers);
+    std::vector<double> audio_seconds(n_workers, 0.0);
+    std::atomic<bool> go(false);
+
+    const auto deadline_offset =
+        std::chrono::duration_cast<Clock::duration>(
+            std::chrono::duration<double>(flags.duration_s));
+
+    std::vector<std::thread> threads;
+    for (int w = 0; w < n_workers; ++w) {
+        threads.emplace_back([&, w]() {
+            std::mt19937 rng(flags.seed + w);
+            std::discrete_distribution<size_t> pick(weights.begin(),
+                                                    weights.end());
+            whisper_sampling_strategy strategy = WHISPER_SAMPLING_GREEDY;
+            Params params = Params::from_enum(&strategy);
+            params.with_print_progress(false)
+                ->with_print_realtime(false)
+                ->with_n_threads(flags.threads);
+
+            while (!go.load()) {
+                std::this_thread::yield();
+            }
+            const auto deadline = Clock::now() + deadline_offset;
+            std::vector<float> clip;
+            while (Clock::now() < deadline) {
+                const std::vector<float> &source = clips[pick(rng)];
+                const size_t offset =
+                    source.empty() ? 0
+                                   : std::uniform_int_distribution<size_t>(
+                                         0, source.size() - 1)(rng);
+                clip.resize(source.size());
+                std::rotate_copy(source.begin(), source.begin() + offset,
+                                 source.end(), clip.begin());
+                const auto start = Clock::now();
+                contexts[w].full(params, clip);
+                const auto end = Clock::now();
+                latencies[w].push_back(
+                    std::chrono::duration<double, std::milli>(end - start)
+                        .count());
+                audio_seconds[w] += (double)clip.size() / WHISPER_SAMPLE_RATE;
+            }
+        });
+    }
+
+    const auto start = Clock::now();
+    go.store(true);
+    for (std::thread &t : threads) {
+        t.join();
+    }
+    const double wall_seconds =
+        std::chrono::duration<double>(Clock::now() - start).count();
+
+    for (Context &ctx : contexts) {
+        ctx.free_state();
+    }
+
+    std::vector<double> all;
+    double total_audio = 0.0;
+    for (int w = 0; w < n_workers; ++w) {
+        all.insert(all.end(), latencies[w].begin(), latencies[w].end());
+        total_audio += audio_seconds[w];
+    }
+    std::sort(all.begin(), all.end());
+
+    RunResult result;
+    result.workers = n_workers;
+    result.requests = all.size();
+    result.audio_seconds = total_audio;
+    result.wall_seconds = wall_seconds;
+    result.p50_ms = percentile(all, 0.50);
+    result.p95_ms = percentile(all, 0.95);
+    result.p99_ms = percentile(all, 0.99);
+    return result;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    Flags flags = parse_flags(argc, argv);
+
+    std::vector<float> pcm;
+    std::vector<std::vector<float>> pcm_stereo;
+    if (!::read_wav(flags.audio, pcm, pcm_stereo, false) || pcm.empty()) {
+        fprintf(stderr, "failed to load audio '%s'\n", flags.audio.c_str());
+        return 1;
+    }
+
+    std::vector<std::vector<float>> clips;
+    for (const ClipSpec &spec : flags.clip_mix) {
+        clips.push_back(make_clip(pcm, spec.seconds));
+    }
+
+    // NOTE: one shared context without a default state, each worker
+    // allocates its own whisper_state on top of it.
+    Context base = Context::from_file(flags.model.c_str(), true);
+
+    printf("[\n");
+    for (size_t i = 0; i < flags.workers.size(); ++i) {
+        RunResult r = run(base, flags, clips, flags.workers[i]);
+        // audio-hours per wall-hour is the same ratio as audio-seconds per
+        // wall-second.
+        printf("  {\"workers\": %d, \"threads_per_worker\": %d, "
+               "\"requests\": %zu, \"audio_seconds\": %.3f, "
+               "\"wall_seconds\": %.3f, \"audio_hours_per_wall_hour\": %.3f, "
+               "\"p50_ms\": %.3f, \"p95_ms\": %.3f, \"p99_ms\": %.3f}%s\n",
+               r.workers, flags.threads, r.requests, r.audio_seconds,
+               r.wall_seconds, r.audio_seconds / r.wall_seconds, r.p50_ms,
+               r.p95_ms, r.p99_ms, i + 1 < flags.workers.size() ? "," : "");
+        fflush(stdout);
+    }
+    printf("]\n");
+
+    base.free();
+    return 0;
+}
@@ -0,0 +1,160 @@
+// Streaming latency benchmark on replayed audio.
+//
+// --audio is replayed through whisper::AudioReplay into stream_transcribe for
+// every step_ms:length_ms:keep_ms triple in --configs. With --realtime the
+// audio is fed at 1x speed, which reproduces what a live microphone would
+// see. Without it the stream runs on a virtual clock as fast as inference
+// allows, which is deterministic and useful to compare CPU cost.
+//
+// Results are written to stdout as a JSON array, one object per config.
+#include "examples/common.h"
+#include "src/whispercpp/audio.h"
+#include "src/whispercpp/context.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace {
+
+struct StreamConfig {
+    int step_ms;
+    int length_ms;
+    int keep_ms;
+};
+
+struct Flags {
+    std::string model = "tests/models/ggml-tiny.en.bin";
+    std::string audio = "samples/jfk.wav";
+    std::vector<StreamConfig> configs = {
+        {3000, 10000, 200}, {1000, 5000, 200}, {500, 5000, 200}};
+    int threads = 4;
+    bool realtime = false;
+};
+
+// --configs=3000:10000:200,500:5000:200 (step_ms:length_ms:keep_ms)
+std::vector<StreamConfig> parse_configs(const char *value) {
+    std::vector<StreamConfig> out;
+    const char *p = value;
+    while (*p != '\0') {
+        char *end;
+        StreamConfig config = {0, 10000, 200};
+        config.step_ms = (int)std::strtol(p, &end, 10);
+        if (end == p) {
+            break;
+        }
+        if (*end == ':') {
+            config.length_ms = (int)std::strtol(end + 1, &end, 10);
+        }
+        if (*end == ':') {
+            config.keep_ms = (int)std::strtol(end + 1, &end, 10);
+        }
+        out.push_back(config);
+        if (*end != ',') {
+            break;
+        }
+        p = end + 1;
+    }
+    return out;
+}
+
+Flags parse_flags(int argc, char **argv) {
+    Flags flags;
+    for (int i = 1; i < argc; ++i) {
+        const char *arg = argv[i];
+        if (strncmp(arg, "--model=", 8) == 0) {
+            flags.model = arg + 8;
+        } else if (strncmp(arg, "--audio=", 8) == 0) {
+            flags.audio = arg + 8;
+        } else if (strncmp(arg, "--configs=", 10) == 0) {
+            flags.configs = parse_configs(arg + 10);
+        } else if (strncmp(arg, "--threads=", 10) == 0) {
+            flags.threads = std::max(1, std::atoi(arg + 10));
+        } else if (strcmp(arg, "--realtime") == 0) {
+            flags.realtime = true;
+        } else {
+            fprintf(stderr, "unknown flag: %s\n", arg);
+            std::exit(1);
+        }
+    }
+    return flags;
+}
+
+double percentile(std::vector<double> sorted, double q) {
+    if (sorted.empty()) {
+        return 0.0;
+    }
+    std::sort(sorted.begin(), sorted.end());
+    size_t rank = (size_t)std::ceil(q * sorted.size());
+    rank = std::min(std::max<size_t>(rank, 1), sorted.size());
+    return sorted[rank - 1];
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    Flags flags = parse_flags(argc, argv);
+
+    std::vector<float> pcm;
+    std::vector<std::vector<float>> pcm_stereo;
+    if (!::read_wav(flags.audio, pcm, pcm_stereo, false) || pcm.empty()) {
+        fprintf(stderr, "failed to load audio '%s'\n", flags.audio.c_str());
+        return 1;
+    }
+
+    Context ctx = Context::from_file(flags.model.c_str(), false);
+
+    printf("[\n");
+    for (size_t i = 0; i < flags.configs.size(); ++i) {
+        const StreamConfig &config = flags.configs[i];
+
+        whisper::whisper_default_params wparams;
+        wparams.n_threads = flags.threads;
+        wparams.step_ms = config.step_ms;
+        wparams.length_ms = config.length_ms;
+        wparams.keep_ms = config.keep_ms;
+        wparams.print_results = false;
+
+        whisper_sampling_strategy strategy = WHISPER_SAMPLING_GREEDY;
+        Params params = Params::from_enum(&strategy);
+        params.with_print_timestamps(false);
+
+        whisper::AudioReplay source(std::max(config.length_ms, 2000), pcm,
+                                    flags.realtime);
+        whisper::StreamStats stats;
+        if (source.stream_transcribe(&ctx, &params, wparams, &stats) != 0) {
+            fprintf(stderr, "stream_transcribe failed for config %zu\n", i);
+            return 1;
+        }
+
+        printf("  {\"step_ms\": %d, \"length_ms\": %d, \"keep_ms\": %d, "
+               "\"realtime\": %s, \"steps\": %d, "
+               "\"first_partial_latency_ms\": %.3f, "
+               "\"final_segment_lag_ms\": %.3f, "
+               "\"step_latency_p50_ms\": %.3f, "
+               "\"step_latency_p95_ms\": %.3f, "
+               "\"dropped_seconds\": %.3f, \"audio_seconds\": %.3f, "
+               "\"cpu_seconds\": %.3f, \"cpu_seconds_per_audio_second\": "
+               "%.3f}%s\n",
+               config.step_ms, config.length_ms, config.keep_ms,
+               flags.realtime ? "true" : "false", stats.n_iter,
+               stats.first_partial_latency_ms, stats.final_segment_lag_ms,
+               percentile(stats.step_latency_ms, 0.50),
+               percentile(stats.step_latency_ms, 0.95),
+               (double)stats.dropped_samples / WHISPER_SAMPLE_RATE,
+               stats.audio_seconds, stats.cpu_seconds,
+               stats.audio_seconds > 0
+                   ? stats.cpu_seconds / stats.audio_seconds
+                   : 0.0,
+               i + 1 < flags.configs.size() ? "," : "");
+        fflush(stdout);
+    }
+    printf("]\n");
+
+    ctx.free();
+    return 0;
+}
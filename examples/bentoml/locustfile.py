@@ -8,4 +8,9 @@ class TranscribeUser(HttpUser):
 
     @task
     def transcribe(self):
-        self.client.post("/transcribe", data="./samples/jfk.wav")
+        # NOTE: the file path is resolved by the service, relative to where it runs.
+        self.client.post(
+            "/transcribe_file",
+            data="./samples/jfk.wav",
+            headers={"Content-Type": "text/plain"},
+        )
@@ -66,6 +66,15 @@ def internal_deps():
         ],
     )
 
+    # google/benchmark, used by //benchmarks
+    maybe(
+        http_archive,
+        name = "com_github_google_benchmark",
+        sha256 = "6430e4092653380d9dc4ccb45a1e2dc9259d581f4866dc0759713126056bc1d7",
+        strip_prefix = "benchmark-1.7.1",
+        urls = ["https://github.com/google/benchmark/archive/refs/tags/v1.7.1.tar.gz"],
+    )
+
     # whisper.cpp
     maybe(
         new_git_repository,
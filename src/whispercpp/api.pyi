@@ -121,6 +121,24 @@ class Params:
     def with_logprob_threshold(self, logprob_thold: float) -> Params: ...
     no_speech_threshold: float
     def with_no_speech_threshold(self, no_speech_thold: float) -> Params: ...
+    @property
+    def encoder_threads(self) -> int: ...
+    def with_encoder_threads(self, threads: int) -> Params: ...
+    @property
+    def decoder_threads(self) -> int: ...
+    def with_decoder_threads(self, threads: int) -> Params: ...
+    @property
+    def numa_node(self) -> int: ...
+    def with_numa_node(self, numa_node: int) -> Params: ...
+    @property
+    def speculative_fallback(self) -> int: ...
+    def with_speculative_fallback(self, n_states: int) -> Params: ...
+    def with_allowed_tokens(self, tokens: list[int]) -> Params: ...
+    def with_denied_tokens(self, tokens: list[int]) -> Params: ...
+    def with_token_bias(self, bias: dict[int, float]) -> Params: ...
+    def with_max_token_length(self, max_length: int) -> Params: ...
+    def with_hotwords(self, phrases: list[str], boost: float = ...) -> Params: ...
+    def with_regex_constraint(self, pattern: str) -> Params: ...
     def set_tokens(self, tokens: list[int]) -> None: ...
     def build(self) -> Params: ...
     @staticmethod
@@ -136,6 +154,12 @@ class Params:
 
 T = t.TypeVar("T")
 
+class ParamsSnapshot:
+    decoding_hash: int
+    def __init__(self, params: Params) -> None: ...
+    def __hash__(self) -> int: ...
+    def __eq__(self, other: object) -> bool: ...
+
 class Context:
     is_initialized: bool = ...
     lang_max_id: int
@@ -144,6 +168,7 @@ class Context:
     n_text_ctx: int
     n_audio_ctx: int
     is_multilingual: bool
+    model_id: str
     eot_token: int
     sot_token: int
     prev_token: int
@@ -153,7 +178,7 @@ class Context:
     token_translate: int
     token_transcribe: int
     def lang_token(self, lang_id: int) -> int: ...
-    def init_state(self) -> None: ...
+    def init_state(self, numa_node: int = ..., kv_f16: bool = ...) -> None: ...
     @staticmethod
     @t.overload
     def from_file(filename: str) -> Context: ...
@@ -167,6 +192,7 @@ class Context:
     @t.overload
     def from_buffer(buffer: bytes, no_state: bool = ...) -> Context: ...
     def free(self) -> None: ...
+    def trim_state(self) -> int: ...
     @t.overload
     def pc_to_mel(self, pcm: NDArray[t.Any]) -> None: ...
     @t.overload
@@ -181,6 +207,8 @@ class Context:
     def encode(self, offset: int) -> None: ...
     @t.overload
     def encode(self, offset: int, threads: int = ...) -> None: ...
+    def get_encoder_output(self) -> tuple[NDArray[t.Any], NDArray[t.Any]]: ...
+    def set_encoder_output(self, k: NDArray[t.Any], v: NDArray[t.Any]) -> None: ...
     @t.overload
     def decode(self, token: list[int], n_past: int) -> None: ...
     @t.overload
@@ -192,19 +220,38 @@ class Context:
     def lang_detect(self, offset_ms: int) -> list[float]: ...
     @t.overload
     def lang_detect(self, offset_ms: int, threads: int = ...) -> list[float]: ...
+    def lang_detect_batch(
+        self,
+        clips: list[NDArray[np.float32]],
+        n_states: int = ...,
+        threads: int = ...,
+        audio_ctx: int = ...,
+    ) -> NDArray[np.float32]: ...
     def get_logits(self, segment: int) -> list[list[float]]: ...
     def token_to_str(self, token_id: int) -> str: ...
     def token_to_bytes(self, token_id: int) -> bytes: ...
-    def full(self, params: Params, data: NDArray[t.Any]) -> int: ...
+    def full(self, params: Params | ParamsSnapshot, data: NDArray[t.Any]) -> int: ...
     def full_parallel(
         self, params: Params, data: NDArray[t.Any], num_processor: int
     ) -> int: ...
+    def full_multi(
+        self, variants: list[Params], data: NDArray[t.Any]
+    ) -> list[list[tuple[int, int, str]]]: ...
+    def full_segments(self) -> list[tuple[int, int, str]]: ...
+    transcription_cache: TranscriptionCache | None
+    def set_transcription_cache(self, cache: TranscriptionCache | None) -> None: ...
     def full_get_segment_text(self, segment: int) -> str: ...
     def full_get_token_data(self, segment: int, token: int) -> TokenData: ...
     def full_lang_id(self) -> int: ...
     def full_get_segment_start(self, segment: int) -> int: ...
     def full_get_segment_end(self, segment: int) -> int: ...
     def full_n_segments(self) -> int: ...
+    def autotune(
+        self,
+        profile_path: str = ...,
+        force: bool = ...,
+        max_workers: int = ...,
+    ) -> TuneProfile: ...
     def full_n_tokens(self, segment: int) -> int: ...
     def full_get_token_id(self, segment: int, token: int) -> int: ...
     def full_get_token_text(self, segment: int, token: int) -> str: ...
@@ -228,4 +275,51 @@ class TokenData:
     t1: int
     vlen: float
 
+class TuneProfile:
+    model: str
+    cpus: int
+    n_threads: int
+    encoder_threads: int
+    decoder_threads: int
+    n_workers: int
+    n_processors: int
+    encode_ms: float
+    decode_ms: float
+    from_cache: bool
+    def apply(self, params: Params) -> Params: ...
+    def save(self, path: str) -> bool: ...
+    @staticmethod
+    def load(path: str) -> TuneProfile | None: ...
+
+class PipelineScheduler:
+    n_states: int
+    encoder_cpus: list[int]
+    decoder_cpus: list[int]
+    decoder_slices: list[list[int]]
+    def __init__(
+        self,
+        context: Context,
+        n_states: int = ...,
+        encoder_cpus: list[int] = ...,
+        decoder_cpus: list[int] = ...,
+    ) -> None: ...
+    def transcribe(
+        self, params: Params, data: NDArray[t.Any]
+    ) -> list[tuple[int, int, str]]: ...
+
+class TranscriptionCache:
+    size: int
+    bytes: int
+    hits: int
+    misses: int
+    path: str
+    def __init__(self, capacity_bytes: int = ..., path: str = ...) -> None: ...
+    def clear(self) -> None: ...
+
 def load_wav_file(filename: str) -> WavFile: ...
+def set_thread_pool_policy(spin_us: int = ..., pin_threads: bool = ...) -> None: ...
+def thread_pool_size() -> int: ...
+def set_cpu_budget(n_cores: int = ..., elastic: bool = ...) -> None: ...
+def get_cpu_budget() -> int: ...
+def numa_nodes() -> list[list[int]]: ...
+def effective_cpus() -> int: ...
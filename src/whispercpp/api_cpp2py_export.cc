@@ -76,5 +76,17 @@ PYBIND11_MODULE(api_cpp2py_export, m) {
     // NOTE: export Params API
     ExportSamplingStrategiesApi(m);
     ExportParamsApi(m);
+
+    // NOTE: export the worker pool used by graph computes
+    ExportThreadPoolApi(m);
+
+    // NOTE: export the thread count autotuner profile
+    ExportAutotuneApi(m);
+
+    // NOTE: export the stage-pipelined scheduler
+    ExportPipelineApi(m);
+
+    // NOTE: export the transcription result cache
+    ExportCacheApi(m);
 }
 }; // namespace whisper
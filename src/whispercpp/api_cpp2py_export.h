@@ -7,6 +7,10 @@
 #include "pybind11/numpy.h"
 #include "pybind11/pybind11.h"
 #include "pybind11/stl.h"
+#include "autotune.h"
+#include "cache.h"
+#include "pipeline.h"
+#include "threadpool.h"
 #else
 #include "common.h"
 #include "context.h"
@@ -14,6 +18,10 @@
 #include "pybind11/numpy.h"
 #include "pybind11/pybind11.h"
 #include "pybind11/stl.h"
+#include "autotune.h"
+#include "cache.h"
+#include "pipeline.h"
+#include "threadpool.h"
 #endif
 
 namespace py = pybind11;
@@ -4,6 +4,9 @@
 #include <fstream>
 #include <thread>
 #include <vector>
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
 
 namespace whisper {
 PYBIND11_MODULE(audio_cpp2py_export, m) {
@@ -90,13 +93,16 @@ bool AudioCapture::init_device(int capture_id, int sample_rate) {
                 capture_spec_obtained.samples);
     }
 
-    m_sample_rate = capture_spec_obtained.freq;
-
-    m_audio.resize((m_sample_rate * m_length_ms) / 1000);
+    init_buffer(capture_spec_obtained.freq);
 
     return true;
 };
 
+void AudioSource::init_buffer(int sample_rate) {
+    m_sample_rate = sample_rate;
+    m_audio.resize((m_sample_rate * m_length_ms) / 1000);
+}
+
 bool AudioCapture::resume() {
     if (!m_dev_id) {
         fprintf(stderr,
@@ -109,6 +115,7 @@ bool AudioCapture::resume() {
     }
 
     SDL_PauseAudioDevice(m_dev_id, 0);
+    m_t_resume = std::chrono::steady_clock::now();
     m_running = true;
     return true;
 };
@@ -135,9 +142,13 @@ bool AudioCapture::clear() {
                 "Failed to clear because there is no audio device to!\n");
         return false;
     }
+    return AudioSource::clear();
+};
+
+bool AudioSource::clear() {
     if (!m_running) {
         fprintf(stderr,
-                "Failed to clear because the audio device is not running!\n");
+                "Failed to clear because the audio source is not running!\n");
         return false;
     }
 
@@ -146,6 +157,7 @@ bool AudioCapture::clear() {
         // Reset current position
         m_audio_pos = 0;
         m_audio_len = 0;
+        m_pending = 0;
     }
 
     return true;
@@ -156,10 +168,10 @@ void AudioCapture::callback(uint8_t *stream, int len) {
         return;
     }
 
-    const size_t num_samples = len / sizeof(float);
+    push(reinterpret_cast<const float *>(stream), len / sizeof(float));
+};
 
-    m_audio_new.resize(num_samples);
-    memcpy(m_audio_new.data(), stream, num_samples * sizeof(float));
+void AudioSource::push(const float *stream, size_t num_samples) {
     // fprintf(stderr, "%zu samples, pos %zu, len %zu\n", num_samples,
     // m_audio_pos, m_audio_len);
 
@@ -167,6 +179,20 @@ void AudioCapture::callback(uint8_t *stream, int len) {
     {
         std::lock_guard<std::mutex> lock(m_mutex);
 
+        // samples the stream has not consumed yet are overwritten. In VAD
+        // mode the buffer is never cleared, and overwriting samples that
+        // were already transcribed loses nothing.
+        m_pending += num_samples;
+        if (m_pending > m_audio.size()) {
+            m_dropped += m_pending - m_audio.size();
+            m_pending = m_audio.size();
+        }
+
+        if (num_samples > m_audio.size()) {
+            stream += num_samples - m_audio.size();
+            num_samples = m_audio.size();
+        }
+
         if (m_audio_pos + num_samples > m_audio.size()) {
             const size_t n0 = m_audio.size() - m_audio_pos;
 
@@ -191,11 +217,32 @@ void AudioCapture::get(int ms, std::vector<float> &audio) {
                 "Failed to retrieve audio because there is no audio device");
         return;
     }
+    AudioSource::get(ms, audio);
+}
 
+bool AudioCapture::poll() {
+    return sdl_poll_events();
+}
+
+void AudioSource::consume(size_t num_samples) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_pending > num_samples) {
+        m_dropped += m_pending - num_samples;
+    }
+    m_pending = 0;
+}
+
+int64_t AudioSource::now_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+               std::chrono::steady_clock::now() - m_t_resume)
+        .count();
+}
+
+void AudioSource::get(int ms, std::vector<float> &audio) {
     if (!m_running) {
         fprintf(
             stderr,
-            "Failed to retrieve audio because the audio device is not running");
+            "Failed to retrieve audio because the audio source is not running");
         return;
     }
 
@@ -231,26 +278,76 @@ void AudioCapture::get(int ms, std::vector<float> &audio) {
     }
 }
 
-// excerpt from stream.cpp
-struct whisper_default_params {
-    // clang-format off
-  int32_t n_threads    = std::min(4, (int32_t)std::thread::hardware_concurrency());
-  int32_t step_ms      = 3000;
-  int32_t length_ms    = 10000;
-  int32_t keep_ms      = 200;
-  int32_t max_tokens   = 32;
-  int32_t audio_ctx    = 0;
-  float vad_thold      = 0.6f;
-  float freq_thold     = 100.0f;
-  bool speed_up        = false;
-  bool translate       = false;
-  bool print_special   = false;
-  bool no_context      = true;
-  bool no_timestamps   = true;
-  std::string language = "en";
-    // clang-format on
+bool AudioReplay::resume() {
+    if (m_running) {
+        fprintf(stderr, "Already running!\n");
+        return false;
+    }
+
+    m_t_resume = std::chrono::steady_clock::now();
+    m_running = true;
+
+    if (m_realtime && !m_feeder.joinable()) {
+        m_stop_feeder = false;
+        m_feeder = std::thread([this]() {
+            // push 10ms chunks at 1x speed, relative to the first resume()
+            const size_t chunk = m_sample_rate / 100;
+            const auto t_start = std::chrono::steady_clock::now();
+            size_t n_chunk = 0;
+            while (!m_stop_feeder && !exhausted()) {
+                if (m_running) {
+                    feed(chunk);
+                }
+                ++n_chunk;
+                std::this_thread::sleep_until(
+                    t_start + std::chrono::milliseconds(10 * n_chunk));
+            }
+        });
+    }
+    return true;
+};
+
+bool AudioReplay::pause() {
+    if (!m_running) {
+        fprintf(stderr, "Already paused!\n");
+        return false;
+    }
+    m_running = false;
+    return true;
 };
 
+void AudioReplay::feed(size_t num_samples) {
+    const size_t fed = m_fed;
+    num_samples = std::min(num_samples, m_samples.size() - fed);
+    push(m_samples.data() + fed, num_samples);
+    m_fed = fed + num_samples;
+}
+
+void AudioReplay::stop_feeder() {
+    m_stop_feeder = true;
+    if (m_feeder.joinable()) {
+        m_feeder.join();
+    }
+}
+
+int64_t AudioReplay::now_ms() {
+    if (m_realtime) {
+        return AudioSource::now_ms();
+    }
+    // virtual clock: the amount of audio produced so far
+    return (int64_t)(1000 * m_fed / m_sample_rate);
+}
+
+void AudioReplay::wait(int ms) {
+    if (m_realtime) {
+        AudioSource::wait(ms);
+        return;
+    }
+    feed((size_t)m_sample_rate * ms / 1000);
+}
+
+bool AudioReplay::poll() { return true; }
+
 //  500 -> 00:05.000
 // 6000 -> 01:00.000
 std::string to_timestamp(int64_t t) {
@@ -272,8 +369,8 @@ std::string to_timestamp(int64_t t) {
         }                                                                      \
     } while (0)
 
-int AudioCapture::stream_transcribe(Context *ctx, Params *params,
-                                    const py::kwargs &kwargs) {
+int AudioSource::stream_transcribe(Context *ctx, Params *params,
+                                   const py::kwargs &kwargs) {
     // very experiemental
     whisper_default_params wparams;
 
@@ -291,9 +388,49 @@ int AudioCapture::stream_transcribe(Context *ctx, Params *params,
     KWARGS_OR_DEFAULT(bool, print_special);
     KWARGS_OR_DEFAULT(bool, no_context);
     KWARGS_OR_DEFAULT(bool, no_timestamps);
+    KWARGS_OR_DEFAULT(bool, print_results);
     KWARGS_OR_DEFAULT(std::string, language);
     // END: DEFAULT PARAMS
 
+    m_check_signals = true;
+    const int ret = stream_transcribe(ctx, params, wparams, &m_stats);
+    m_check_signals = false;
+
+    if (ret == 0) {
+        ctx->free();
+    }
+    return ret;
+}
+
+// CPU time of the whole process, user and system, across every thread.
+static double process_cpu_seconds() {
+#ifndef _WIN32
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0.0;
+    }
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+           1e-6 * (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec);
+#else
+    return 0.0;
+#endif
+}
+
+static double elapsed_ms(std::chrono::steady_clock::time_point since) {
+    return std::chrono::duration<double, std::milli>(
+               std::chrono::steady_clock::now() - since)
+        .count();
+}
+
+int AudioSource::stream_transcribe(Context *ctx, Params *params,
+                                   whisper_default_params wparams,
+                                   StreamStats *stats) {
+    StreamStats local_stats;
+    if (stats == nullptr) {
+        stats = &local_stats;
+    }
+    *stats = StreamStats();
+
     wparams.keep_ms = std::min(wparams.keep_ms, wparams.step_ms);
     wparams.length_ms = std::max(wparams.length_ms, wparams.step_ms);
 
@@ -328,7 +465,7 @@ int AudioCapture::stream_transcribe(Context *ctx, Params *params,
     std::vector<whisper_token> prompt_tokens;
 
     // START
-    {
+    if (wparams.print_results) {
         fprintf(stderr, "\n");
         if (!ctx->is_multilingual()) {
             if (wparams.language != "en" || wparams.translate) {
@@ -369,21 +506,35 @@ int AudioCapture::stream_transcribe(Context *ctx, Params *params,
         fprintf(stderr, "=====================================\n");
         fprintf(stderr, "=== Transcription starting now... ===\n");
         fprintf(stderr, "=====================================\n\n");
+    } else if (!ctx->is_multilingual()) {
+        wparams.language = "en";
+        wparams.translate = false;
     }
 
     int n_iter = 0;
 
     bool is_running = true;
+    // set once the source ran dry, the remaining audio is flushed and the
+    // loop ends after the next inference.
+    bool is_last = false;
 
     fflush(stdout);
 
-    auto time_last = std::chrono::high_resolution_clock::now();
-    const auto time_start = time_last;
+    int64_t time_last = this->now_ms();
+    const int64_t time_start = time_last;
+
+    const auto wall_start = std::chrono::steady_clock::now();
+    auto wall_exhausted = wall_start;
+    const double cpu_start = process_cpu_seconds();
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_dropped = 0;
+    }
 
     while (is_running) {
-        is_running = sdl_poll_events();
+        is_running = this->poll();
 
-        if (!is_running || PyErr_CheckSignals() != 0) {
+        if (!is_running || (m_check_signals && PyErr_CheckSignals() != 0)) {
             fprintf(stderr, "\n\nCaught Ctrl-C. Exiting ...\n");
             break;
         }
@@ -399,16 +550,37 @@ int AudioCapture::stream_transcribe(Context *ctx, Params *params,
                             "enough, dropping "
                             "audio ...\n\n",
                             __func__);
+                    stats->dropped_samples += pcmf32_new.size();
                     this->clear();
                     continue;
                 }
 
-                if ((int)pcmf32_new.size() >= num_samples_step) {
+                if ((int)pcmf32_new.size() >= num_samples_step ||
+                    this->exhausted()) {
+                    {
+                        // whatever arrived on top of the step is discarded
+                        std::lock_guard<std::mutex> lock(m_mutex);
+                        if (m_audio_len > pcmf32_new.size()) {
+                            stats->dropped_samples +=
+                                m_audio_len - pcmf32_new.size();
+                        }
+                    }
                     this->clear();
                     break;
                 }
 
-                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                const int missing_ms =
+                    (num_samples_step - (int)pcmf32_new.size()) * 1000 /
+                    WHISPER_SAMPLE_RATE;
+                this->wait(std::max(1, std::min(missing_ms, 10)));
+            }
+
+            if (this->exhausted()) {
+                is_last = true;
+                wall_exhausted = std::chrono::steady_clock::now();
+                if (pcmf32_new.empty()) {
+                    break;
+                }
             }
 
             const int num_samples_new = pcmf32_new.size();
@@ -427,31 +599,47 @@ int AudioCapture::stream_transcribe(Context *ctx, Params *params,
             memcpy(pcmf32.data() + num_samples_take, pcmf32_new.data(), num_samples_new * sizeof(float));
             // clang-format on
             pcmf32_old = pcmf32_new;
+            stats->audio_seconds += (double)num_samples_new / WHISPER_SAMPLE_RATE;
         } else {
-            const auto time_now = std::chrono::high_resolution_clock::now();
-            const auto time_diff =
-                std::chrono::duration_cast<std::chrono::milliseconds>(time_now -
-                                                                      time_last)
-                    .count();
-
-            if (time_diff < 2000) {
-                std::this_thread::sleep_for(std::chrono::milliseconds(100));
-                continue;
-            }
+            const int64_t time_now = this->now_ms();
+            const int64_t time_diff = time_now - time_last;
+
+            if (this->exhausted()) {
+                // flush what was captured since the last transcription
+                is_last = true;
+                wall_exhausted = std::chrono::steady_clock::now();
+                this->get(std::min((int)(time_diff), wparams.length_ms),
+                          pcmf32);
+                this->consume(pcmf32.size());
+                if (pcmf32.empty()) {
+                    break;
+                }
+            } else {
+                if (time_diff < 2000) {
+                    this->wait(100);
+                    continue;
+                }
 
-            this->get(2000, pcmf32_new);
+                this->get(2000, pcmf32_new);
 
-            if (::vad_simple(pcmf32_new, WHISPER_SAMPLE_RATE, 1000,
-                             wparams.vad_thold, wparams.freq_thold, false)) {
-                this->get(wparams.length_ms, pcmf32);
-            } else {
-                std::this_thread::sleep_for(std::chrono::milliseconds(100));
-                continue;
+                if (::vad_simple(pcmf32_new, WHISPER_SAMPLE_RATE, 1000,
+                                 wparams.vad_thold, wparams.freq_thold,
+                                 false)) {
+                    this->get(wparams.length_ms, pcmf32);
+                    this->consume(pcmf32.size());
+                } else {
+                    this->consume(pcmf32_new.size());
+                    this->wait(100);
+                    continue;
+                }
             }
 
             time_last = time_now;
+            stats->audio_seconds += (double)pcmf32.size() / WHISPER_SAMPLE_RATE;
         }
 
+        const auto wall_step = std::chrono::steady_clock::now();
+
         // Running inference
         {
             // clang-format off
@@ -477,8 +665,10 @@ int AudioCapture::stream_transcribe(Context *ctx, Params *params,
                 return 6;
             }
 
+            const int n_segments = ctx->full_n_segments();
+
             // print results
-            {
+            if (wparams.print_results) {
                 // clang-format off
                 if (!use_vad) {
                     printf("\33[2K\r");
@@ -486,14 +676,13 @@ int AudioCapture::stream_transcribe(Context *ctx, Params *params,
                     printf("%s", std::string(100, ' ').c_str());
                     printf("\33[2K\r");
                 } else {
-                    const int64_t t1 = (time_last - time_start).count() / 1000000;
+                    const int64_t t1 = time_last - time_start;
                     const int64_t t0 = std::max(0.0, t1 - pcmf32.size() * 1000.0 / WHISPER_SAMPLE_RATE);
                     printf("\n");
                     printf("### Transcription %d START | t0 = %d ms | t1 = %d " "ms\n", n_iter, (int)t0, (int)t1);
                     printf("\n");
                 }
 
-                const int n_segments = ctx->full_n_segments();
                 for (int i = 0; i < n_segments; ++i) {
                     const char *text = ctx->full_get_segment_text(i);
 
@@ -514,15 +703,28 @@ int AudioCapture::stream_transcribe(Context *ctx, Params *params,
                 }
             }
 
+            stats->step_latency_ms.push_back(elapsed_ms(wall_step));
+            if (stats->first_partial_latency_ms < 0) {
+                for (int i = 0; i < n_segments; ++i) {
+                    if (ctx->full_get_segment_text(i)[0] != '\0') {
+                        stats->first_partial_latency_ms =
+                            elapsed_ms(wall_start);
+                        break;
+                    }
+                }
+            }
+
             ++n_iter;
 
             // clang-format off
             if (!use_vad && (n_iter % n_new_line) == 0) {
-                printf("\n");
+                if (wparams.print_results) {
+                    printf("\n");
+                }
 
                 // keep part of the audio for next iteration to try to
                 // mitigate word boundary issues
-                pcmf32_old = std::vector<float>(pcmf32.end() - num_samples_keep, pcmf32.end());
+                pcmf32_old = std::vector<float>(pcmf32.end() - std::min((int)pcmf32.size(), num_samples_keep), pcmf32.end());
 
                 // Add tokens of the last full length segment as the prompt
                 if (!wparams.no_context) {
@@ -539,13 +741,25 @@ int AudioCapture::stream_transcribe(Context *ctx, Params *params,
             }
             // clang-format on
         }
+
+        if (is_last) {
+            stats->final_segment_lag_ms = elapsed_ms(wall_exhausted);
+            break;
+        }
     }
 
     this->pause();
-    if (params->get()->print_timestamps) {
+
+    stats->n_iter = n_iter;
+    stats->cpu_seconds = process_cpu_seconds() - cpu_start;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        stats->dropped_samples += m_dropped;
+    }
+
+    if (params->get()->print_timestamps && wparams.print_results) {
         ctx->print_timings();
     }
-    ctx->free();
 
     return 0;
 }
@@ -567,15 +781,35 @@ bool sdl_poll_events() {
 
 void ExportAudioApi(py::module &m) {
     m.def("sdl_poll_events", &sdl_poll_events, "Poll SDL events");
-    py::class_<whisper::AudioCapture>(m, "AudioCapture")
+    py::class_<whisper::StreamStats>(m, "StreamStats")
+        .def_readonly("n_iter", &whisper::StreamStats::n_iter)
+        .def_readonly("first_partial_latency_ms",
+                      &whisper::StreamStats::first_partial_latency_ms)
+        .def_readonly("final_segment_lag_ms",
+                      &whisper::StreamStats::final_segment_lag_ms)
+        .def_readonly("step_latency_ms",
+                      &whisper::StreamStats::step_latency_ms)
+        .def_readonly("dropped_samples",
+                      &whisper::StreamStats::dropped_samples)
+        .def_readonly("audio_seconds", &whisper::StreamStats::audio_seconds)
+        .def_readonly("cpu_seconds", &whisper::StreamStats::cpu_seconds);
+    py::class_<whisper::AudioSource>(m, "AudioSource")
+        .def("stream_transcribe",
+             static_cast<int (whisper::AudioSource::*)(
+                 Context *, Params *, const py::kwargs &)>(
+                 &whisper::AudioSource::stream_transcribe),
+             py::keep_alive<0, 1>())
+        .def("resume", &whisper::AudioSource::resume)
+        .def("pause", &whisper::AudioSource::pause)
+        .def("clear", &whisper::AudioSource::clear)
+        .def_property_readonly("stats", &whisper::AudioSource::stats);
+    py::class_<whisper::AudioCapture, whisper::AudioSource>(m, "AudioCapture")
         .def(py::init<int>())
         .def("init_device", &whisper::AudioCapture::init_device,
              "device_id"_a = -1, "sample_rate"_a = WHISPER_SAMPLE_RATE)
         .def_static("list_available_devices",
-                    &whisper::AudioCapture::list_available_devices)
-        .def("stream_transcribe", &whisper::AudioCapture::stream_transcribe,
-             py::keep_alive<0, 1>())
-        .def("resume", &whisper::AudioCapture::resume)
-        .def("pause", &whisper::AudioCapture::pause)
-        .def("clear", &whisper::AudioCapture::clear);
+                    &whisper::AudioCapture::list_available_devices);
+    py::class_<whisper::AudioReplay, whisper::AudioSource>(m, "AudioReplay")
+        .def(py::init<int, std::vector<float>, bool>(), "length_ms"_a,
+             "samples"_a, "realtime"_a = true);
 };
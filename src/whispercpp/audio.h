@@ -20,8 +20,10 @@
 
 #include "context.h"
 #include <atomic>
+#include <chrono>
 #include <cstdint>
 #include <mutex>
+#include <thread>
 #include <vector>
 
 // Using SDL as audio capture
@@ -29,13 +31,118 @@
 namespace py = pybind11;
 
 namespace whisper {
-class AudioCapture {
+
+// excerpt from stream.cpp
+struct whisper_default_params {
+    // clang-format off
+  int32_t n_threads    = std::min(4, (int32_t)std::thread::hardware_concurrency());
+  int32_t step_ms      = 3000;
+  int32_t length_ms    = 10000;
+  int32_t keep_ms      = 200;
+  int32_t max_tokens   = 32;
+  int32_t audio_ctx    = 0;
+  float vad_thold      = 0.6f;
+  float freq_thold     = 100.0f;
+  bool speed_up        = false;
+  bool translate       = false;
+  bool print_special   = false;
+  bool no_context      = true;
+  bool no_timestamps   = true;
+  bool print_results   = true;
+  std::string language = "en";
+    // clang-format on
+};
+
+// Measurements collected by a single stream_transcribe run.
+struct StreamStats {
+    int n_iter = 0;
+    // Wall time from the start of the stream until the first non-empty
+    // partial transcript. -1 if nothing was transcribed.
+    double first_partial_latency_ms = -1.0;
+    // Wall time between the source running out of audio and the final
+    // segment being emitted. Only set for sources that end.
+    double final_segment_lag_ms = -1.0;
+    // Wall time of each inference step, from the moment its audio was
+    // available until its transcript was emitted.
+    std::vector<double> step_latency_ms;
+    // Samples discarded before inference ever saw them, because it could
+    // not keep up.
+    int64_t dropped_samples = 0;
+    // Seconds of audio consumed, and the CPU time of the whole process
+    // (every thread, not only the stream's) spent meanwhile.
+    double audio_seconds = 0.0;
+    double cpu_seconds = 0.0;
+};
+
+// Base class for the audio fed into stream_transcribe. Keeps the last
+// length_ms of audio in a circular buffer that producers push() into.
+class AudioSource {
   public:
-    AudioCapture(int length_ms) {
+    AudioSource(int length_ms) {
         m_length_ms = length_ms;
         m_running = false;
     };
 
+    virtual ~AudioSource() = default;
+
+    virtual bool resume() = 0;
+    virtual bool pause() = 0;
+    virtual bool clear();
+
+    // retrieve audio data from the buffer
+    virtual void get(int ms, std::vector<float> &audio);
+
+    // Milliseconds elapsed on this source's clock since resume().
+    virtual int64_t now_ms();
+    // Block until roughly ms more milliseconds of audio could be available.
+    virtual void wait(int ms) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+    }
+    // Return false if the stream should stop.
+    virtual bool poll() { return true; }
+    // Whether the source has no more audio to produce. Live sources never
+    // run dry.
+    virtual bool exhausted() { return false; }
+
+    int stream_transcribe(Context *, Params *, const py::kwargs &);
+    int stream_transcribe(Context *, Params *, whisper_default_params,
+                          StreamStats *stats = nullptr);
+
+    const StreamStats &stats() const { return m_stats; }
+
+  protected:
+    // append samples to the circular buffer
+    void push(const float *samples, size_t num_samples);
+    void init_buffer(int sample_rate);
+    // The stream handled the last num_samples samples (transcribed them,
+    // or found no speech in them). Samples pushed before those and never
+    // handled are counted as dropped.
+    void consume(size_t num_samples);
+
+    int m_length_ms = 0;
+    int m_sample_rate = 0;
+
+    std::atomic_bool m_running;
+    std::mutex m_mutex;
+
+    std::vector<float> m_audio;
+    size_t m_audio_pos = 0;
+    size_t m_audio_len = 0;
+    // samples pushed since the stream last consumed the buffer, they count
+    // as dropped once overwritten
+    size_t m_pending = 0;
+    int64_t m_dropped = 0;
+
+    std::chrono::steady_clock::time_point m_t_resume;
+
+    bool m_check_signals = false;
+    StreamStats m_stats;
+};
+
+class AudioCapture : public AudioSource {
+  public:
+    AudioCapture(int length_ms) : AudioSource(length_ms){};
+
     ~AudioCapture() {
         if (m_dev_id) {
             SDL_CloseAudioDevice(m_dev_id);
@@ -47,32 +154,58 @@ class AudioCapture {
     static std::vector<int> list_available_devices();
 
     // Needs to keep the last len_ms of audio in circular buffer
-    bool resume();
-    bool pause();
-    bool clear();
+    bool resume() override;
+    bool pause() override;
+    bool clear() override;
 
     // implement a SDL callback
     void callback(uint8_t *stream, int len);
 
     // retrieve audio data from the buffer
-    void get(int ms, std::vector<float> &audio);
+    void get(int ms, std::vector<float> &audio) override;
 
-    int stream_transcribe(Context *, Params *, const py::kwargs &);
+    bool poll() override;
 
   private:
     // Default device
     SDL_AudioDeviceID m_dev_id = 0;
+};
 
-    int m_length_ms = 0;
-    int m_sample_rate = 0;
+// Replays in-memory audio as if it was captured live. With realtime = true
+// a feeder thread pushes samples at 1x speed against the wall clock. With
+// realtime = false audio is produced on demand, on a virtual clock that only
+// advances while the consumer waits, so the stream runs as fast as inference
+// allows and is fully deterministic.
+class AudioReplay : public AudioSource {
+  public:
+    AudioReplay(int length_ms, std::vector<float> samples, bool realtime,
+                int sample_rate = WHISPER_SAMPLE_RATE)
+        : AudioSource(length_ms), m_samples(std::move(samples)),
+          m_realtime(realtime) {
+        init_buffer(sample_rate);
+    };
 
-    std::atomic_bool m_running;
-    std::mutex m_mutex;
+    ~AudioReplay() { stop_feeder(); }
 
-    std::vector<float> m_audio;
-    std::vector<float> m_audio_new;
-    size_t m_audio_pos = 0;
-    size_t m_audio_len = 0;
+    bool resume() override;
+    bool pause() override;
+
+    int64_t now_ms() override;
+    void wait(int ms) override;
+    bool poll() override;
+    bool exhausted() override { return m_fed >= m_samples.size(); }
+
+  private:
+    void feed(size_t num_samples);
+    void stop_feeder();
+
+    std::vector<float> m_samples;
+    bool m_realtime;
+
+    // samples pushed so far, only written by the feeding side
+    std::atomic<size_t> m_fed{0};
+    std::thread m_feeder;
+    std::atomic_bool m_stop_feeder{false};
 };
 
 } // namespace whisper
@@ -10,16 +10,23 @@ from .api import Context
 
 def sdl_poll_events() -> bool: ...
 
-class AudioCapture:
-    def __init__(self, length_ms: int) -> None: ...
-    @t.overload
-    def init_device(self) -> bool: ...
-    @t.overload
-    def init_device(self, device_id: int) -> bool: ...
-    @t.overload
-    def init_device(self, device_id: int, sample_rate: int) -> bool: ...
-    @staticmethod
-    def list_available_devices() -> list[int]: ...
+class StreamStats:
+    @property
+    def n_iter(self) -> int: ...
+    @property
+    def first_partial_latency_ms(self) -> float: ...
+    @property
+    def final_segment_lag_ms(self) -> float: ...
+    @property
+    def step_latency_ms(self) -> list[float]: ...
+    @property
+    def dropped_samples(self) -> int: ...
+    @property
+    def audio_seconds(self) -> float: ...
+    @property
+    def cpu_seconds(self) -> float: ...
+
+class AudioSource:
     @t.overload
     def stream_transcribe(
         self, context: Context, params: Params
@@ -31,4 +38,22 @@ class AudioCapture:
     def resume(self) -> bool: ...
     def pause(self) -> bool: ...
     def clear(self) -> bool: ...
+    @property
+    def stats(self) -> StreamStats: ...
+
+class AudioReplay(AudioSource):
+    def __init__(
+        self, length_ms: int, samples: NDArray[np.float32], realtime: bool = ...
+    ) -> None: ...
+
+class AudioCapture(AudioSource):
+    def __init__(self, length_ms: int) -> None: ...
+    @t.overload
+    def init_device(self) -> bool: ...
+    @t.overload
+    def init_device(self, device_id: int) -> bool: ...
+    @t.overload
+    def init_device(self, device_id: int, sample_rate: int) -> bool: ...
+    @staticmethod
+    def list_available_devices() -> list[int]: ...
     def retrieve_audio(self, ms: int, audio: NDArray[np.float32]) -> None: ...
@@ -0,0 +1,388 @@
+#include "automaton.h"
+
+#include <algorithm>
+#include <bitset>
+#include <map>
+#include <memory>
+#include <stdexcept>
+
+namespace whisper {
+
+namespace {
+
+typedef std::bitset<256> ByteSet;
+
+// Upper bound for {m,n} counts, every repetition is a copy of the NFA.
+const int kMaxRepeat = 64;
+
+struct Node {
+    enum Kind { SET, CONCAT, ALT, REPEAT } kind;
+    ByteSet set;
+    std::vector<std::unique_ptr<Node>> children;
+    int min = 0;
+    // -1 for unbounded
+    int max = 0;
+
+    explicit Node(Kind kind) : kind(kind) {}
+};
+
+class Parser {
+  public:
+    explicit Parser(const std::string &pattern) : m_s(pattern), m_pos(0) {}
+
+    std::unique_ptr<Node> parse() {
+        std::unique_ptr<Node> node = alternation();
+        if (m_pos != m_s.size()) {
+            fail("unexpected ')'");
+        }
+        return node;
+    }
+
+  private:
+    void fail(const std::string &what) const {
+        throw std::invalid_argument("invalid pattern '" + m_s + "' at " +
+                                    std::to_string(m_pos) + ": " + what);
+    }
+    bool done() const { return m_pos >= m_s.size(); }
+    char peek() const { return m_s[m_pos]; }
+
+    std::unique_ptr<Node> alternation() {
+        std::unique_ptr<Node> node(new Node(Node::ALT));
+        node->children.push_back(concatenation());
+        while (!done() && peek() == '|') {
+            ++m_pos;
+            node->children.push_back(concatenation());
+        }
+        if (node->children.size() == 1) {
+            return std::move(node->children[0]);
+        }
+        return node;
+    }
+
+    std::unique_ptr<Node> concatenation() {
+        std::unique_ptr<Node> node(new Node(Node::CONCAT));
+        while (!done() && peek() != '|' && peek() != ')') {
+            node->children.push_back(repetition());
+        }
+        return node;
+    }
+
+    int number() {
+        const size_t begin = m_pos;
+        while (!done() && peek() >= '0' && peek() <= '9') {
+            ++m_pos;
+        }
+        if (begin == m_pos || m_pos - begin > 3) {
+            fail("expected a count");
+        }
+        return std::stoi(m_s.substr(begin, m_pos - begin));
+    }
+
+    std::unique_ptr<Node> repetition() {
+        std::unique_ptr<Node> node = atom();
+        while (!done()) {
+            int min, max;
+            const char c = peek();
+            if (c == '*') {
+                min = 0, max = -1;
+            } else if (c == '+') {
+                min = 1, max = -1;
+            } else if (c == '?') {
+                min = 0, max = 1;
+            } else if (c == '{') {
+                ++m_pos;
+                min = max = number();
+                if (!done() && peek() == ',') {
+                    ++m_pos;
+                    max = !done() && peek() == '}' ? -1 : number();
+                }
+                if (done() || peek() != '}') {
+                    fail("expected '}'");
+                }
+                if (max != -1 && max < min) {
+                    fail("bad count range");
+                }
+                if (std::max(min, max) > kMaxRepeat) {
+                    fail("count above " + std::to_string(kMaxRepeat));
+                }
+            } else {
+                break;
+            }
+            ++m_pos;
+            std::unique_ptr<Node> repeat(new Node(Node::REPEAT));
+            repeat->min = min;
+            repeat->max = max;
+            repeat->children.push_back(std::move(node));
+            node = std::move(repeat);
+        }
+        return node;
+    }
+
+    // the set an escape stands for, m_pos is past the backslash
+    ByteSet escape() {
+        if (done()) {
+            fail("trailing '\\'");
+        }
+        const char c = m_s[m_pos++];
+        ByteSet set;
+        switch (c) {
+        case 'd':
+        case 'D':
+            for (int b = '0'; b <= '9'; ++b) {
+                set.set(b);
+            }
+            break;
+        case 's':
+        case 'S':
+            for (const char *p = " \t\n\r\f\v"; *p; ++p) {
+                set.set((unsigned char)*p);
+            }
+            break;
+        case 'w':
+        case 'W':
+            for (int b = 0; b < 256; ++b) {
+                if ((b >= '0' && b <= '9') || (b >= 'a' && b <= 'z') ||
+                    (b >= 'A' && b <= 'Z') || b == '_') {
+                    set.set(b);
+                }
+            }
+            break;
+        case 'n':
+            set.set('\n');
+            break;
+        case 't':
+            set.set('\t');
+            break;
+        default:
+            if ((c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') ||
+                (c >= 'A' && c <= 'Z')) {
+                fail(std::string("unknown escape '\\") + c + "'");
+            }
+            set.set((unsigned char)c);
+            return set;
+        }
+        return c >= 'A' && c <= 'Z' ? ~set : set;
+    }
+
+    ByteSet byte_class() {
+        // m_pos is past the '['
+        bool negate = false;
+        if (!done() && peek() == '^') {
+            negate = true;
+            ++m_pos;
+        }
+        ByteSet set;
+        bool first = true;
+        while (!done() && (peek() != ']' || first)) {
+            first = false;
+            unsigned char lo = (unsigned char)m_s[m_pos++];
+            if (lo == '\\') {
+                const ByteSet escaped = escape();
+                if (escaped.count() != 1) {
+                    set |= escaped;
+                    continue;
+                }
+                for (int b = 0; b < 256; ++b) {
+                    if (escaped.test(b)) {
+                        lo = (unsigned char)b;
+                    }
+                }
+            }
+            unsigned char hi = lo;
+            if (m_pos + 1 < m_s.size() && peek() == '-' &&
+                m_s[m_pos + 1] != ']') {
+                hi = (unsigned char)m_s[m_pos + 1];
+                m_pos += 2;
+                if (hi < lo) {
+                    fail("bad class range");
+                }
+            }
+            for (int b = lo; b <= hi; ++b) {
+                set.set(b);
+            }
+        }
+        if (done()) {
+            fail("expected ']'");
+        }
+        ++m_pos;
+        return negate ? ~set : set;
+    }
+
+    std::unique_ptr<Node> atom() {
+        const char c = m_s[m_pos++];
+        std::unique_ptr<Node> node(new Node(Node::SET));
+        switch (c) {
+        case '(':
+            node = alternation();
+            if (done() || peek() != ')') {
+                fail("expected ')'");
+            }
+            ++m_pos;
+            return node;
+        case '[':
+            node->set = byte_class();
+            return node;
+        case '.':
+            node->set.set();
+            node->set.reset('\n');
+            return node;
+        case '\\':
+            node->set = escape();
+            return node;
+        case '*':
+        case '+':
+        case '?':
+        case '{':
+            --m_pos;
+            fail("nothing to repeat");
+        }
+        node->set.set((unsigned char)c);
+        return node;
+    }
+
+    const std::string &m_s;
+    size_t m_pos;
+};
+
+// Thompson NFA: every state has epsilon edges and at most one byte edge.
+class Nfa {
+  public:
+    struct State {
+        std::vector<int> eps;
+        ByteSet set;
+        int next = -1;
+    };
+
+    int add() {
+        m_states.push_back(State());
+        return (int)m_states.size() - 1;
+    }
+
+    // Build node between new states, returns (start, end).
+    std::pair<int, int> build(const Node &node) {
+        const int start = add();
+        int end = start;
+        switch (node.kind) {
+        case Node::SET:
+            end = add();
+            m_states[start].set = node.set;
+            m_states[start].next = end;
+            break;
+        case Node::CONCAT:
+            for (const std::unique_ptr<Node> &child : node.children) {
+                const std::pair<int, int> part = build(*child);
+                m_states[end].eps.push_back(part.first);
+                end = part.second;
+            }
+            break;
+        case Node::ALT:
+            end = add();
+            for (const std::unique_ptr<Node> &child : node.children) {
+                const std::pair<int, int> part = build(*child);
+                m_states[start].eps.push_back(part.first);
+                m_states[part.second].eps.push_back(end);
+            }
+            break;
+        case Node::REPEAT: {
+            const Node &child = *node.children[0];
+            for (int i = 0; i < node.min; ++i) {
+                const std::pair<int, int> part = build(child);
+                m_states[end].eps.push_back(part.first);
+                end = part.second;
+            }
+            if (node.max == -1) {
+                const std::pair<int, int> part = build(child);
+                const int out = add();
+                m_states[end].eps.push_back(part.first);
+                m_states[end].eps.push_back(out);
+                m_states[part.second].eps.push_back(part.first);
+                m_states[part.second].eps.push_back(out);
+                end = out;
+            } else {
+                const int out = add();
+                for (int i = node.min; i < node.max; ++i) {
+                    const std::pair<int, int> part = build(child);
+                    m_states[end].eps.push_back(part.first);
+                    m_states[end].eps.push_back(out);
+                    end = part.second;
+                }
+                m_states[end].eps.push_back(out);
+                end = out;
+            }
+            break;
+        }
+        }
+        return std::make_pair(start, end);
+    }
+
+    // states reachable from set through epsilon edges, sorted
+    std::vector<int> closure(std::vector<int> set) const {
+        std::vector<bool> seen(m_states.size(), false);
+        for (int s : set) {
+            seen[s] = true;
+        }
+        for (size_t i = 0; i < set.size(); ++i) {
+            for (int e : m_states[set[i]].eps) {
+                if (!seen[e]) {
+                    seen[e] = true;
+                    set.push_back(e);
+                }
+            }
+        }
+        std::sort(set.begin(), set.end());
+        set.erase(std::unique(set.begin(), set.end()), set.end());
+        return set;
+    }
+
+    const State &state(int i) const { return m_states[i]; }
+
+  private:
+    std::vector<State> m_states;
+};
+
+} // namespace
+
+const int ByteDfa::kDead;
+
+ByteDfa::ByteDfa(const std::string &pattern, int max_states)
+    : m_pattern(pattern) {
+    const std::unique_ptr<Node> ast = Parser(pattern).parse();
+    Nfa nfa;
+    const std::pair<int, int> ends = nfa.build(*ast);
+
+    // subset construction
+    std::map<std::vector<int>, int> ids;
+    std::vector<std::vector<int>> sets;
+    sets.push_back(nfa.closure(std::vector<int>(1, ends.first)));
+    ids[sets[0]] = 0;
+    for (size_t i = 0; i < sets.size(); ++i) {
+        m_accepting.push_back(
+            std::binary_search(sets[i].begin(), sets[i].end(), ends.second));
+        m_next.resize(m_next.size() + 256, kDead);
+        for (int c = 0; c < 256; ++c) {
+            std::vector<int> moved;
+            for (int s : sets[i]) {
+                if (nfa.state(s).next != -1 && nfa.state(s).set.test(c)) {
+                    moved.push_back(nfa.state(s).next);
+                }
+            }
+            if (moved.empty()) {
+                continue;
+            }
+            moved = nfa.closure(moved);
+            std::map<std::vector<int>, int>::iterator it = ids.find(moved);
+            if (it == ids.end()) {
+                if ((int)sets.size() >= max_states) {
+                    throw std::invalid_argument(
+                        "pattern '" + pattern + "' needs more than " +
+                        std::to_string(max_states) + " automaton states");
+                }
+                it = ids.insert(std::make_pair(moved, (int)sets.size())).first;
+                sets.push_back(moved);
+            }
+            m_next[i * 256 + c] = it->second;
+        }
+    }
+}
+
+} // namespace whisper
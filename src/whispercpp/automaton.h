@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace whisper {
+
+// Deterministic automaton over bytes, compiled from a regular expression.
+// The whole text has to match, as if the pattern were anchored at both
+// ends. Supported syntax:
+//   literals, '.', escapes \d \D \s \S \w \W and \<punctuation>,
+//   classes [abc] [a-z] [^0-9], groups (...), alternation |,
+//   repetition * + ? {m} {m,} {m,n}.
+// Throws std::invalid_argument on a malformed pattern, or when the
+// automaton would have more than max_states states.
+class ByteDfa {
+  public:
+    static const int kDead = -1;
+
+    explicit ByteDfa(const std::string &pattern, int max_states = 512);
+
+    int start() const { return 0; }
+    int step(int state, unsigned char c) const {
+        return state == kDead ? kDead : m_next[state * 256 + c];
+    }
+    int step(int state, const char *text) const {
+        for (; *text != '\0' && state != kDead; ++text) {
+            state = step(state, (unsigned char)*text);
+        }
+        return state;
+    }
+    bool accepting(int state) const {
+        return state != kDead && m_accepting[state];
+    }
+    int n_states() const { return (int)m_accepting.size(); }
+    const std::string &pattern() const { return m_pattern; }
+
+  private:
+    std::string m_pattern;
+    // n_states x 256, kDead where no transition
+    std::vector<int> m_next;
+    std::vector<bool> m_accepting;
+};
+
+} // namespace whisper
@@ -0,0 +1,322 @@
+#include "autotune.h"
+#include "threadpool.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <exception>
+#include <fstream>
+#include <thread>
+
+namespace whisper {
+
+namespace {
+
+// a few seconds of tones over low-level noise, enough to exercise the mel
+// filterbank. The encoder always runs on the full window, so its cost does
+// not depend on the content.
+std::vector<float> synthetic_audio(float seconds) {
+    std::vector<float> pcm((size_t)(seconds * WHISPER_SAMPLE_RATE));
+    const float two_pi = 6.28318531f;
+    uint32_t seed = 0x9e3779b9u;
+    for (size_t i = 0; i < pcm.size(); ++i) {
+        const float t = (float)i / WHISPER_SAMPLE_RATE;
+        seed = seed * 1664525u + 1013904223u;
+        const float noise = ((float)(seed >> 8) / (1 << 24) - 0.5f) * 0.02f;
+        pcm[i] = 0.1f * std::sin(two_pi * 220.0f * t) +
+                 0.05f * std::sin(two_pi * 1760.0f * t) + noise;
+    }
+    return pcm;
+}
+
+double elapsed_ms(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(
+               std::chrono::steady_clock::now() - start)
+        .count();
+}
+
+// 1, 2, 4, ... up to and including n_cpus
+std::vector<int> thread_candidates(int n_cpus) {
+    std::vector<int> out;
+    for (int n = 1; n < n_cpus; n *= 2) {
+        out.push_back(n);
+    }
+    out.push_back(n_cpus);
+    return out;
+}
+
+// Index of the fastest timing. Anything within 5% of it counts as a tie,
+// which goes to the earlier (smaller) candidate: extra threads that do not
+// buy a clear speedup are better left to other requests.
+size_t pick_fastest(const std::vector<double> &ms) {
+    size_t best = 0;
+    for (size_t i = 1; i < ms.size(); ++i) {
+        if (ms[i] < ms[best]) {
+            best = i;
+        }
+    }
+    for (size_t i = 0; i < best; ++i) {
+        if (ms[i] <= ms[best] * 1.05) {
+            return i;
+        }
+    }
+    return best;
+}
+
+} // namespace
+
+bool TuneProfile::save(const std::string &path) const {
+    // write next to the target and rename, so a concurrent load never sees
+    // a partial file
+    const std::string tmp = path + ".tmp";
+    {
+        std::ofstream file(tmp.c_str(), std::ios::trunc);
+        if (!file) {
+            return false;
+        }
+        file << "# whispercpp autotune profile\n"
+             << "model=" << model << "\n"
+             << "cpus=" << cpus << "\n"
+             << "n_threads=" << n_threads << "\n"
+             << "encoder_threads=" << encoder_threads << "\n"
+             << "decoder_threads=" << decoder_threads << "\n"
+             << "n_workers=" << n_workers << "\n"
+             << "n_processors=" << n_processors << "\n"
+             << "encode_ms=" << encode_ms << "\n"
+             << "decode_ms=" << decode_ms << "\n";
+        if (!file) {
+            return false;
+        }
+    }
+    return std::rename(tmp.c_str(), path.c_str()) == 0;
+}
+
+bool TuneProfile::load(const std::string &path, TuneProfile *profile) {
+    std::ifstream file(path.c_str());
+    if (!file) {
+        return false;
+    }
+    TuneProfile out;
+    std::string line;
+    try {
+        while (std::getline(file, line)) {
+            if (line.empty() || line[0] == '#') {
+                continue;
+            }
+            const size_t eq = line.find('=');
+            if (eq == std::string::npos) {
+                return false;
+            }
+            const std::string key = line.substr(0, eq);
+            const std::string value = line.substr(eq + 1);
+            if (key == "model") {
+                out.model = value;
+            } else if (key == "cpus") {
+                out.cpus = std::stoi(value);
+            } else if (key == "n_threads") {
+                out.n_threads = std::stoi(value);
+            } else if (key == "encoder_threads") {
+                out.encoder_threads = std::stoi(value);
+            } else if (key == "decoder_threads") {
+                out.decoder_threads = std::stoi(value);
+            } else if (key == "n_workers") {
+                out.n_workers = std::stoi(value);
+            } else if (key == "n_processors") {
+                out.n_processors = std::stoi(value);
+            } else if (key == "encode_ms") {
+                out.encode_ms = std::stod(value);
+            } else if (key == "decode_ms") {
+                out.decode_ms = std::stod(value);
+            }
+            // unknown keys are skipped so older readers accept newer files
+        }
+    } catch (const std::logic_error &) {
+        return false;
+    }
+    if (out.model.empty() || out.n_threads < 1) {
+        return false;
+    }
+    out.from_cache = true;
+    *profile = out;
+    return true;
+}
+
+Params *TuneProfile::apply(Params *params) const {
+    return params->with_n_threads(n_threads)
+        ->with_encoder_threads(encoder_threads)
+        ->with_decoder_threads(decoder_threads);
+}
+
+std::string TuneProfile::to_string() const {
+    std::stringstream ss;
+    ss << "TuneProfile(model=" << model << ", cpus=" << cpus
+       << ", n_threads=" << n_threads << ", encoder_threads=" << encoder_threads
+       << ", decoder_threads=" << decoder_threads
+       << ", n_workers=" << n_workers << ", n_processors=" << n_processors
+       << ", encode_ms=" << encode_ms << ", decode_ms=" << decode_ms
+       << ", from_cache=" << (from_cache ? "True" : "False") << ")";
+    return ss.str();
+}
+
+TuneProfile autotune(Context &context, const std::string &profile_path,
+                     bool force, int max_workers) {
+    TuneProfile profile;
+    profile.model = context.model_id();
+    profile.cpus = effective_cpus();
+
+    if (!profile_path.empty() && !force) {
+        TuneProfile cached;
+        if (TuneProfile::load(profile_path, &cached) &&
+            cached.model == profile.model && cached.cpus == profile.cpus) {
+            return cached;
+        }
+    }
+
+    std::vector<float> pcm = synthetic_audio(2.0f);
+    std::vector<whisper_token> prompt = {context.sot_token()};
+    const std::vector<int> candidates = thread_candidates(profile.cpus);
+    const int n_decode_steps = 4;
+
+    // NOTE: tune on a state of our own, leaving the caller's results alone
+    Context probe = context.clone_with_state();
+    std::vector<double> encode_ms;
+    std::vector<double> decode_ms;
+    try {
+        probe.pc_to_mel(pcm, 1, false);
+        // warm up caches and the thread pool before timing anything
+        probe.encode(0, profile.cpus);
+
+        for (int n_threads : candidates) {
+            // NOTE: encode() never reuses the K/V cache of an earlier call
+            // on the same window, so every timing runs the encoder and the
+            // cross-attention graphs
+            std::chrono::steady_clock::time_point start =
+                std::chrono::steady_clock::now();
+            probe.encode(0, n_threads);
+            encode_ms.push_back(elapsed_ms(start));
+
+            // decoder steps are short and noisy, keep the fastest
+            double best = 0.0;
+            for (int i = 0; i < n_decode_steps; ++i) {
+                start = std::chrono::steady_clock::now();
+                probe.decode(&prompt, 0, n_threads);
+                const double ms = elapsed_ms(start);
+                best = i == 0 ? ms : std::min(best, ms);
+            }
+            decode_ms.push_back(best);
+        }
+    } catch (...) {
+        probe.free_state();
+        throw;
+    }
+    probe.free_state();
+
+    const size_t encoder_best = pick_fastest(encode_ms);
+    const size_t decoder_best = pick_fastest(decode_ms);
+    profile.encode_ms = encode_ms[encoder_best];
+    profile.decode_ms = decode_ms[decoder_best];
+
+    // Encoder throughput of n_workers states encoding at once, each with an
+    // equal split of the cpus. Wider machines usually do better running
+    // several requests on fewer threads each than one request on all.
+    std::vector<int> workers = {1};
+    std::vector<double> throughput = {1.0 / encode_ms[encoder_best]};
+    for (int n = 2; n <= std::min(max_workers, profile.cpus); n *= 2) {
+        std::vector<Context> probes;
+        double ms = 0.0;
+        std::vector<std::exception_ptr> errors(n);
+        try {
+            for (int i = 0; i < n; ++i) {
+                probes.push_back(context.clone_with_state());
+                probes.back().pc_to_mel(pcm, 1, false);
+            }
+            const int n_threads = std::max(1, profile.cpus / n);
+            const std::chrono::steady_clock::time_point start =
+                std::chrono::steady_clock::now();
+            std::vector<std::thread> threads;
+            for (int i = 0; i < n; ++i) {
+                threads.emplace_back([&probes, &errors, i, n_threads] {
+                    try {
+                        probes[i].encode(0, n_threads);
+                    } catch (...) {
+                        errors[i] = std::current_exception();
+                    }
+                });
+            }
+            for (std::thread &thread : threads) {
+                thread.join();
+            }
+            ms = elapsed_ms(start);
+        } catch (...) {
+            for (Context &p : probes) {
+                p.free_state();
+            }
+            throw;
+        }
+        for (Context &p : probes) {
+            p.free_state();
+        }
+        for (const std::exception_ptr &error : errors) {
+            if (error) {
+                std::rethrow_exception(error);
+            }
+        }
+        workers.push_back(n);
+        throughput.push_back(n / ms);
+    }
+    size_t workers_best = 0;
+    for (size_t i = 1; i < workers.size(); ++i) {
+        // same 5% margin as pick_fastest, in favour of fewer workers
+        if (throughput[i] > throughput[workers_best] * 1.05) {
+            workers_best = i;
+        }
+    }
+    profile.n_workers = workers[workers_best];
+    profile.n_processors = profile.n_workers;
+
+    const int share = std::max(1, profile.cpus / profile.n_workers);
+    profile.encoder_threads = std::min(candidates[encoder_best], share);
+    profile.decoder_threads = std::min(candidates[decoder_best], share);
+    profile.n_threads = profile.encoder_threads;
+
+    if (!profile_path.empty() && !profile.save(profile_path)) {
+        fprintf(stderr, "%s: failed to write autotune profile '%s'\n",
+                __func__, profile_path.c_str());
+    }
+    return profile;
+}
+
+} // namespace whisper
+
+void ExportAutotuneApi(py::module &m) {
+    py::class_<whisper::TuneProfile>(
+        m, "TuneProfile",
+        "Thread counts and parallelism measured by Context.autotune()")
+        .def(py::init<>())
+        .def_readonly("model", &whisper::TuneProfile::model)
+        .def_readonly("cpus", &whisper::TuneProfile::cpus)
+        .def_readonly("n_threads", &whisper::TuneProfile::n_threads)
+        .def_readonly("encoder_threads",
+                      &whisper::TuneProfile::encoder_threads)
+        .def_readonly("decoder_threads",
+                      &whisper::TuneProfile::decoder_threads)
+        .def_readonly("n_workers", &whisper::TuneProfile::n_workers)
+        .def_readonly("n_processors", &whisper::TuneProfile::n_processors)
+        .def_readonly("encode_ms", &whisper::TuneProfile::encode_ms)
+        .def_readonly("decode_ms", &whisper::TuneProfile::decode_ms)
+        .def_readonly("from_cache", &whisper::TuneProfile::from_cache)
+        .def("apply", &whisper::TuneProfile::apply, "params"_a,
+             py::return_value_policy::reference)
+        .def("save", &whisper::TuneProfile::save, "path"_a)
+        .def_static(
+            "load",
+            [](const std::string &path) -> py::object {
+                whisper::TuneProfile profile;
+                if (!whisper::TuneProfile::load(path, &profile)) {
+                    return py::none();
+                }
+                return py::cast(profile);
+            },
+            "path"_a)
+        .def("__repr__", &whisper::TuneProfile::to_string);
+}
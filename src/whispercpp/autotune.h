@@ -0,0 +1,55 @@
+#pragma once
+
+#include "context.h"
+
+#include <string>
+
+namespace whisper {
+
+// Thread counts and parallelism picked by autotune() for one model on one
+// machine. Thread counts are per request, sized so that n_workers requests
+// (or full_parallel processors) can run side by side.
+struct TuneProfile {
+    // identifies the model and machine the profile was measured on
+    std::string model;
+    int cpus = 1;
+
+    int n_threads = 1;
+    int encoder_threads = 0;
+    int decoder_threads = 0;
+    // number of concurrent requests with the best total throughput, also
+    // the num_processor to use with full_parallel
+    int n_workers = 1;
+    int n_processors = 1;
+
+    // best single request timings, in milliseconds
+    double encode_ms = 0.0;
+    double decode_ms = 0.0;
+
+    // true if the profile was read back from disk instead of measured
+    bool from_cache = false;
+
+    // Plain key=value lines. save() returns false if the file could not be
+    // written, load() if it could not be read or parsed.
+    bool save(const std::string &path) const;
+    static bool load(const std::string &path, TuneProfile *profile);
+
+    // Set n_threads, encoder_threads and decoder_threads on params.
+    Params *apply(Params *params) const;
+
+    std::string to_string() const;
+};
+
+// Time short encodes and decodes of synthetic audio on a temporary state of
+// the context over a range of thread counts, then the encoder throughput of
+// up to max_workers concurrent states, and return the best configuration.
+// The number of cpus considered is effective_cpus(), so cgroup CPU quotas
+// are respected. With a non-empty profile_path, a profile saved there for
+// the same model and cpu count is returned as is unless force is set, and
+// a freshly measured profile is saved there.
+TuneProfile autotune(Context &context, const std::string &profile_path = "",
+                     bool force = false, int max_workers = 4);
+
+} // namespace whisper
+
+void ExportAutotuneApi(py::module &m);
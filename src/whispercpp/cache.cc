@@ -0,0 +1,398 @@
+#include "cache.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace py = pybind11;
+using namespace pybind11::literals;
+
+namespace whisper {
+
+static inline uint64_t mix64(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return h;
+}
+
+uint64_t hash_bytes(const void *data, size_t size, uint64_t seed) {
+    // NOTE: data may be null then
+    if (size == 0) {
+        return seed;
+    }
+    // eight bytes at a time, so hashing long recordings stays well below
+    // the cost of decoding them
+    const uint8_t *p = static_cast<const uint8_t *>(data);
+    uint64_t h = mix64(seed ^ (size * 0x9e3779b97f4a7c15ull));
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, p + i, sizeof(word));
+        h = (h ^ mix64(word)) * 0x9e3779b97f4a7c15ull;
+        h = (h << 31) | (h >> 33);
+    }
+    uint64_t tail = 0;
+    memcpy(&tail, p + i, size - i);
+    return mix64(h ^ mix64(tail));
+}
+
+template <typename T> static uint64_t hash_value(const T &value, uint64_t h) {
+    return hash_bytes(&value, sizeof(value), h);
+}
+
+uint64_t hash_params(const whisper_full_params &params, uint64_t seed) {
+    uint64_t h = seed;
+    h = hash_value((int)params.strategy, h);
+    h = hash_value(params.n_max_text_ctx, h);
+    h = hash_value(params.offset_ms, h);
+    h = hash_value(params.duration_ms, h);
+    h = hash_value(params.translate, h);
+    h = hash_value(params.no_context, h);
+    h = hash_value(params.single_segment, h);
+    h = hash_value(params.token_timestamps, h);
+    h = hash_value(params.thold_pt, h);
+    h = hash_value(params.thold_ptsum, h);
+    h = hash_value(params.max_len, h);
+    h = hash_value(params.split_on_word, h);
+    h = hash_value(params.max_tokens, h);
+    h = hash_value(params.speed_up, h);
+    h = hash_value(params.audio_ctx, h);
+    h = hash_bytes(params.prompt_tokens,
+                   params.prompt_tokens == nullptr
+                       ? 0
+                       : params.prompt_n_tokens * sizeof(whisper_token),
+                   h);
+    const char *language = params.language == nullptr ? "" : params.language;
+    h = hash_bytes(language, strlen(language), h);
+    h = hash_value(params.suppress_blank, h);
+    h = hash_value(params.suppress_non_speech_tokens, h);
+    h = hash_value(params.temperature, h);
+    h = hash_value(params.max_initial_ts, h);
+    h = hash_value(params.length_penalty, h);
+    h = hash_value(params.temperature_inc, h);
+    h = hash_value(params.entropy_thold, h);
+    h = hash_value(params.logprob_thold, h);
+    h = hash_value(params.no_speech_thold, h);
+    h = hash_value(params.greedy.best_of, h);
+    h = hash_value(params.beam_search.beam_size, h);
+    h = hash_value(params.beam_search.patience, h);
+    return h;
+}
+
+size_t CachedTranscript::bytes() const {
+    size_t n = sizeof(*this) + prompt_past.size() * sizeof(whisper_token);
+    for (const CachedSegment &segment : segments) {
+        n += sizeof(segment) + segment.text.size() +
+             segment.tokens.size() * sizeof(whisper_token_data);
+    }
+    return n;
+}
+
+// On-disk layout, native endianness:
+//   u32 magic, u32 version, u64 audio, u64 n_samples, u64 params, u64 model,
+//   i32 lang_id, u32 n_segments,
+//   per segment: i64 t0, i64 t1, u32 n_text, text, u32 n_tokens, tokens
+//   u32 n_prompt_past, prompt_past
+static const uint32_t kCacheMagic = 0x43544357; // "WCTC"
+static const uint32_t kCacheVersion = 2;
+
+namespace {
+
+class Writer {
+  public:
+    template <typename T> void put(const T &value) {
+        const char *p = reinterpret_cast<const char *>(&value);
+        m_buf.insert(m_buf.end(), p, p + sizeof(T));
+    }
+    void put(const void *data, size_t size) {
+        const char *p = static_cast<const char *>(data);
+        m_buf.insert(m_buf.end(), p, p + size);
+    }
+    const std::vector<char> &buf() const { return m_buf; }
+
+  private:
+    std::vector<char> m_buf;
+};
+
+class Reader {
+  public:
+    Reader(const char *data, size_t size) : m_p(data), m_end(data + size) {}
+
+    template <typename T> bool get(T *value) { return get(value, sizeof(T)); }
+    bool get(void *out, size_t size) {
+        if (size == 0) {
+            return true;
+        }
+        if ((size_t)(m_end - m_p) < size) {
+            return false;
+        }
+        memcpy(out, m_p, size);
+        m_p += size;
+        return true;
+    }
+    // Whether count items of item_size bytes each can still be read. Checked
+    // before sizing anything from a count read off disk.
+    bool fits(size_t count, size_t item_size) const {
+        return count <= (size_t)(m_end - m_p) / item_size;
+    }
+
+  private:
+    const char *m_p;
+    const char *m_end;
+};
+
+} // namespace
+
+static std::vector<char> serialize(const CacheKey &key,
+                                   const CachedTranscript &value) {
+    Writer w;
+    w.put(kCacheMagic);
+    w.put(kCacheVersion);
+    w.put(key.audio);
+    w.put(key.n_samples);
+    w.put(key.params);
+    w.put(key.model);
+    w.put((int32_t)value.lang_id);
+    w.put((uint32_t)value.segments.size());
+    for (const CachedSegment &segment : value.segments) {
+        w.put(segment.t0);
+        w.put(segment.t1);
+        w.put((uint32_t)segment.text.size());
+        w.put(segment.text.data(), segment.text.size());
+        w.put((uint32_t)segment.tokens.size());
+        w.put(segment.tokens.data(),
+              segment.tokens.size() * sizeof(whisper_token_data));
+    }
+    w.put((uint32_t)value.prompt_past.size());
+    w.put(value.prompt_past.data(),
+          value.prompt_past.size() * sizeof(whisper_token));
+    return w.buf();
+}
+
+// Only accepts an entry stored under key, the file name alone does not
+// carry every field of it.
+static bool deserialize(const char *data, size_t size, const CacheKey &key,
+                        CachedTranscript *out) {
+    Reader r(data, size);
+    uint32_t magic, version, n_segments, n;
+    int32_t lang_id;
+    CacheKey stored;
+    if (!r.get(&magic) || magic != kCacheMagic || !r.get(&version) ||
+        version != kCacheVersion || !r.get(&stored.audio) ||
+        !r.get(&stored.n_samples) || !r.get(&stored.params) ||
+        !r.get(&stored.model) || !(stored == key) || !r.get(&lang_id) ||
+        !r.get(&n_segments)) {
+        return false;
+    }
+    // NOTE: a truncated or corrupt entry is rejected before its counts
+    // size anything. Each segment takes at least t0, t1 and two counts.
+    const size_t min_segment = 2 * sizeof(int64_t) + 2 * sizeof(uint32_t);
+    if (!r.fits(n_segments, min_segment)) {
+        return false;
+    }
+    CachedTranscript value;
+    value.lang_id = lang_id;
+    value.segments.resize(n_segments);
+    for (CachedSegment &segment : value.segments) {
+        if (!r.get(&segment.t0) || !r.get(&segment.t1) || !r.get(&n) ||
+            !r.fits(n, 1)) {
+            return false;
+        }
+        segment.text.resize(n);
+        if (!r.get(&segment.text[0], n) || !r.get(&n) ||
+            !r.fits(n, sizeof(whisper_token_data))) {
+            return false;
+        }
+        segment.tokens.resize(n);
+        if (!r.get(segment.tokens.data(), n * sizeof(whisper_token_data))) {
+            return false;
+        }
+    }
+    if (!r.get(&n) || !r.fits(n, sizeof(whisper_token))) {
+        return false;
+    }
+    value.prompt_past.resize(n);
+    if (!r.get(value.prompt_past.data(), n * sizeof(whisper_token))) {
+        return false;
+    }
+    *out = std::move(value);
+    return true;
+}
+
+TranscriptionCache::TranscriptionCache(size_t capacity_bytes, std::string path)
+    : m_capacity(capacity_bytes), m_path(std::move(path)) {}
+
+std::string TranscriptionCache::file_for(const CacheKey &key) const {
+    // the other fields are checked against the ones stored in the file
+    const uint64_t rest = hash_bytes(&key.model, sizeof(key.model),
+                                     hash_bytes(&key.params, sizeof(key.params),
+                                                key.n_samples));
+    char name[48];
+    snprintf(name, sizeof(name), "/%016llx%016llx.bin",
+             (unsigned long long)key.audio, (unsigned long long)rest);
+    return m_path + name;
+}
+
+bool TranscriptionCache::load(const CacheKey &key,
+                              CachedTranscript *out) const {
+    if (m_path.empty()) {
+        return false;
+    }
+    const std::string file = file_for(key);
+#ifndef _WIN32
+    const int fd = open(file.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    bool ok = false;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        void *data =
+            mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            ok = deserialize(static_cast<const char *>(data), st.st_size, key,
+                             out);
+            munmap(data, st.st_size);
+        }
+    }
+    close(fd);
+    return ok;
+#else
+    std::ifstream in(file.c_str(), std::ios::binary);
+    std::vector<char> data((std::istreambuf_iterator<char>(in)),
+                           std::istreambuf_iterator<char>());
+    return !data.empty() &&
+           deserialize(data.data(), data.size(), key, out);
+#endif
+}
+
+void TranscriptionCache::store(const CacheKey &key,
+                               const CachedTranscript &value) const {
+    if (m_path.empty()) {
+        return;
+    }
+    // write next to the entry and rename, so readers in other processes
+    // never map a partial file
+    const std::string file = file_for(key);
+    const std::string tmp = file + ".tmp";
+    const std::vector<char> data = serialize(key, value);
+    {
+        std::ofstream out(tmp.c_str(), std::ios::binary | std::ios::trunc);
+        out.write(data.data(), data.size());
+        if (!out) {
+            std::remove(tmp.c_str());
+            return;
+        }
+    }
+    std::rename(tmp.c_str(), file.c_str());
+}
+
+void TranscriptionCache::insert(const CacheKey &key,
+                                const CachedTranscript &value) {
+    std::map<CacheKey, Lru::iterator>::iterator it = m_index.find(key);
+    if (it != m_index.end()) {
+        m_bytes -= it->second->second.bytes();
+        m_lru.erase(it->second);
+        m_index.erase(it);
+    }
+    const size_t bytes = value.bytes();
+    if (bytes > m_capacity) {
+        return;
+    }
+    while (!m_lru.empty() && m_bytes + bytes > m_capacity) {
+        m_bytes -= m_lru.back().second.bytes();
+        m_index.erase(m_lru.back().first);
+        m_lru.pop_back();
+    }
+    m_lru.push_front(std::make_pair(key, value));
+    m_index[key] = m_lru.begin();
+    m_bytes += bytes;
+}
+
+bool TranscriptionCache::get(const CacheKey &key, CachedTranscript *out) {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        std::map<CacheKey, Lru::iterator>::iterator it = m_index.find(key);
+        if (it != m_index.end()) {
+            m_lru.splice(m_lru.begin(), m_lru, it->second);
+            *out = it->second->second;
+            ++m_hits;
+            return true;
+        }
+    }
+    // NOTE: disk reads happen outside the lock
+    if (load(key, out)) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        insert(key, *out);
+        ++m_hits;
+        return true;
+    }
+    std::lock_guard<std::mutex> lock(m_mutex);
+    ++m_misses;
+    return false;
+}
+
+void TranscriptionCache::put(const CacheKey &key,
+                             const CachedTranscript &value) {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        insert(key, value);
+    }
+    store(key, value);
+}
+
+void TranscriptionCache::clear() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_lru.clear();
+    m_index.clear();
+    m_bytes = 0;
+}
+
+size_t TranscriptionCache::size() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_lru.size();
+}
+
+size_t TranscriptionCache::bytes() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_bytes;
+}
+
+uint64_t TranscriptionCache::hits() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_hits;
+}
+
+uint64_t TranscriptionCache::misses() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_misses;
+}
+
+} // namespace whisper
+
+void ExportCacheApi(py::module &m) {
+    py::class_<whisper::TranscriptionCache,
+               std::shared_ptr<whisper::TranscriptionCache>>(
+        m, "TranscriptionCache",
+        "Transcripts of previously seen audio and params, see "
+        "Context.set_transcription_cache")
+        .def(py::init<size_t, std::string>(), "capacity_bytes"_a = 64 << 20,
+             "path"_a = "")
+        .def("clear", &whisper::TranscriptionCache::clear)
+        .def_property_readonly("size", &whisper::TranscriptionCache::size)
+        .def_property_readonly("bytes", &whisper::TranscriptionCache::bytes)
+        .def_property_readonly("hits", &whisper::TranscriptionCache::hits)
+        .def_property_readonly("misses", &whisper::TranscriptionCache::misses)
+        .def_property_readonly("path", &whisper::TranscriptionCache::path);
+}
@@ -0,0 +1,111 @@
+#pragma once
+
+#ifdef BAZEL_BUILD
+#include "pybind11/pybind11.h"
+#include "whisper.h"
+#else
+#include "pybind11/pybind11.h"
+#include "whisper.h"
+#endif
+
+#include <cstdint>
+#include <list>
+#include <map>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <vector>
+
+namespace whisper {
+
+// 64-bit hash of a buffer, seeded so hashes can be chained.
+uint64_t hash_bytes(const void *data, size_t size, uint64_t seed = 0);
+
+// Hash of the whisper_full_params fields that change what is decoded.
+// Threads, printing and callbacks are left out.
+uint64_t hash_params(const whisper_full_params &params, uint64_t seed = 0);
+
+// Entries match on every field, so a hit needs the same number of samples
+// and three independent hashes to agree, not just one.
+struct CacheKey {
+    // PCM samples
+    uint64_t audio = 0;
+    uint64_t n_samples = 0;
+    // decoding params, see ParamsSnapshot::decoding_hash
+    uint64_t params = 0;
+    // model and the precision of the state's K/V caches
+    uint64_t model = 0;
+
+    bool operator<(const CacheKey &other) const {
+        return std::tie(audio, n_samples, params, model) <
+               std::tie(other.audio, other.n_samples, other.params,
+                        other.model);
+    }
+    bool operator==(const CacheKey &other) const {
+        return audio == other.audio && n_samples == other.n_samples &&
+               params == other.params && model == other.model;
+    }
+};
+
+struct CachedSegment {
+    int64_t t0 = 0;
+    int64_t t1 = 0;
+    std::string text;
+    std::vector<whisper_token_data> tokens;
+};
+
+// Everything Context::full leaves in a state that the result getters and
+// the next call read.
+struct CachedTranscript {
+    int lang_id = -1;
+    std::vector<CachedSegment> segments;
+    std::vector<whisper_token> prompt_past;
+
+    size_t bytes() const;
+};
+
+// Transcripts of previously seen (audio, params) pairs. An LRU tier in
+// memory bounded by capacity_bytes, and with a non-empty path, a tier on
+// disk with one file per entry in that directory, read back with mmap.
+// Disk entries are never evicted and may be shared by several processes.
+class TranscriptionCache {
+  public:
+    explicit TranscriptionCache(size_t capacity_bytes,
+                                std::string path = "");
+
+    TranscriptionCache(const TranscriptionCache &) = delete;
+    TranscriptionCache &operator=(const TranscriptionCache &) = delete;
+
+    bool get(const CacheKey &key, CachedTranscript *out);
+    void put(const CacheKey &key, const CachedTranscript &value);
+    // Empty the memory tier. Disk entries are kept.
+    void clear();
+
+    size_t size();
+    size_t bytes();
+    uint64_t hits();
+    uint64_t misses();
+    const std::string &path() const { return m_path; }
+
+  private:
+    typedef std::list<std::pair<CacheKey, CachedTranscript>> Lru;
+
+    void insert(const CacheKey &key, const CachedTranscript &value);
+    std::string file_for(const CacheKey &key) const;
+    bool load(const CacheKey &key, CachedTranscript *out) const;
+    void store(const CacheKey &key, const CachedTranscript &value) const;
+
+    std::mutex m_mutex;
+    size_t m_capacity;
+    std::string m_path;
+    size_t m_bytes = 0;
+    uint64_t m_hits = 0;
+    uint64_t m_misses = 0;
+    // most recently used first
+    Lru m_lru;
+    std::map<CacheKey, Lru::iterator> m_index;
+};
+
+} // namespace whisper
+
+void ExportCacheApi(pybind11::module &m);
@@ -1,4 +1,26 @@
 #include "context.h"
+#include "autotune.h"
+#include "threadpool.h"
+#ifdef BAZEL_BUILD
+#include "ggml.h"
+#else
+#include "ggml.h"
+#endif
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <exception>
+#include <map>
+#include <mutex>
+#include <thread>
+
+// Every graph compute issued by whisper.cpp goes through
+// whisper_cpp2py_graph_compute (defined below) so the binding can adjust
+// how it runs.
+static void whisper_cpp2py_graph_compute(struct ggml_context *ctx,
+                                         struct ggml_cgraph *cgraph);
+#define ggml_graph_compute whisper_cpp2py_graph_compute
+
 #ifdef BAZEL_BUILD
 #include "whisper.cpp"
 #include <pybind11/pytypes.h>
@@ -7,6 +29,8 @@
 #include <pybind11/pytypes.h>
 #endif
 
+#undef ggml_graph_compute
+
 #if __GNUC__ > 10 || defined(__clang__)
 #define STREAM_CAST
 #else
@@ -51,9 +75,644 @@
         }                                                                      \
     } while (0)
 
-void Context::init_state() {
+// Which part of the model a graph whisper.cpp builds belongs to. The
+// encoder graph starts with the conv stem, decoder graphs are the only ones
+// with a causal mask, and the remaining graph (copying the cross-attention
+// K/V out of the encoder output) is part of encoding.
+static whisper::ComputePhase classify_graph(const struct ggml_cgraph *cgraph) {
+    for (int i = 0; i < cgraph->n_nodes; ++i) {
+        const enum ggml_op op = cgraph->nodes[i]->op;
+        if (op == GGML_OP_CONV_1D_1S) {
+            return whisper::COMPUTE_PHASE_ENCODER;
+        }
+        if (op == GGML_OP_DIAG_MASK_INF) {
+            return whisper::COMPUTE_PHASE_DECODER;
+        }
+    }
+    return whisper::COMPUTE_PHASE_ENCODER;
+}
+
+// The mel window fed to an encoder graph (the input of its first conv),
+// nullptr for any other graph.
+static const struct ggml_tensor *
+encoder_input(const struct ggml_cgraph *cgraph) {
+    for (int i = 0; i < cgraph->n_nodes; ++i) {
+        if (cgraph->nodes[i]->op == GGML_OP_CONV_1D_1S) {
+            return cgraph->nodes[i]->src1;
+        }
+    }
+    return nullptr;
+}
+
+// FNV-1a over the shape and contents of a tensor.
+static uint64_t hash_tensor(const struct ggml_tensor *tensor) {
+    uint64_t hash = 14695981039346656037ull;
+    const auto mix = [&hash](const void *data, size_t size) {
+        const uint8_t *bytes = static_cast<const uint8_t *>(data);
+        for (size_t i = 0; i < size; ++i) {
+            hash = (hash ^ bytes[i]) * 1099511628211ull;
+        }
+    };
+    mix(tensor->ne, sizeof(tensor->ne));
+    mix(tensor->data, ggml_nbytes(tensor));
+    return hash;
+}
+
+// Encoder output reuse. For every state, remember which mel window its
+// cross-attention K/V cache was last computed from. Encoding the same
+// window again on that state, e.g. language detection followed by
+// transcription of the first window, skips both the encoder graph and the
+// cross-attention graph that follows it, since their result is already in
+// the cache. Only applies to computes issued under a ScopedEncoderCache, and
+// only within a single call: the only window carried from one call to the
+// next is the one lang_detect leaves for the full() right after it, so
+// repeated calls on the same audio (benchmarks, autotune) encode every time.
+static std::mutex g_encoder_cache_mutex;
+static std::map<const whisper_state *, uint64_t> g_encoder_cache;
+
+static thread_local whisper_state *g_encoder_cache_state = nullptr;
+// window of the encoder graph being computed, recorded once its
+// cross-attention graph is done
+static thread_local bool g_encoder_cache_pending = false;
+static thread_local uint64_t g_encoder_cache_window = 0;
+// the encoder graph was a hit, so the cross-attention graph is skipped too
+static thread_local bool g_encoder_cache_skip_cross = false;
+
+static void encoder_cache_forget(const whisper_state *state);
+
+// With carry_out, the scope starts from nothing and leaves its last window
+// for the next call (lang_detect). Without it, the scope may reuse the
+// window carried over from the call before and forgets everything when it
+// ends (full).
+class ScopedEncoderCache {
+  public:
+    ScopedEncoderCache(whisper_state *state, bool carry_out)
+        : m_state(state), m_carry_out(carry_out),
+          m_prev(g_encoder_cache_state) {
+        if (m_carry_out) {
+            encoder_cache_forget(m_state);
+        }
+        g_encoder_cache_state = state;
+        g_encoder_cache_pending = false;
+        g_encoder_cache_skip_cross = false;
+    }
+    ~ScopedEncoderCache() {
+        if (!m_carry_out) {
+            encoder_cache_forget(m_state);
+        }
+        g_encoder_cache_state = m_prev;
+        g_encoder_cache_pending = false;
+        g_encoder_cache_skip_cross = false;
+    }
+
+    ScopedEncoderCache(const ScopedEncoderCache &) = delete;
+    ScopedEncoderCache &operator=(const ScopedEncoderCache &) = delete;
+
+  private:
+    whisper_state *m_state;
+    bool m_carry_out;
+    whisper_state *m_prev;
+};
+
+// Encoder outputs shared between the states decoding variants of the same
+// audio (see Context::full_multi). The first state to encode a window
+// publishes its cross-attention K/V, the others wait for it and copy them
+// instead of encoding the window again.
+struct EncoderShare {
+    struct Window {
+        bool ready = false;
+        // states that still have to copy the window
+        int n_pending = 0;
+        std::vector<uint8_t> k;
+        std::vector<uint8_t> v;
+    };
+
+    explicit EncoderShare(int n_states) : n_states(n_states) {}
+
+    const int n_states;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::map<uint64_t, Window> windows;
+};
+
+static thread_local EncoderShare *g_encoder_share = nullptr;
+
+class ScopedEncoderShare {
+  public:
+    explicit ScopedEncoderShare(EncoderShare *share) : m_prev(g_encoder_share) {
+        g_encoder_share = share;
+    }
+    ~ScopedEncoderShare() { g_encoder_share = m_prev; }
+
+    ScopedEncoderShare(const ScopedEncoderShare &) = delete;
+    ScopedEncoderShare &operator=(const ScopedEncoderShare &) = delete;
+
+  private:
+    EncoderShare *m_prev;
+};
+
+// Copy the window into the state's K/V cache if another state encoded or is
+// encoding it. Otherwise the caller encodes it and publishes it from
+// encoder_share_publish.
+static bool encoder_share_fetch(whisper_state *state, uint64_t window) {
+    EncoderShare *share = g_encoder_share;
+    if (share == nullptr) {
+        return false;
+    }
+    std::unique_lock<std::mutex> lock(share->mutex);
+    std::map<uint64_t, EncoderShare::Window>::iterator it =
+        share->windows.find(window);
+    if (it == share->windows.end()) {
+        share->windows[window].n_pending = share->n_states - 1;
+        return false;
+    }
+    EncoderShare::Window &entry = it->second;
+    share->cv.wait(lock, [&entry]() { return entry.ready; });
+    memcpy(state->kv_cross.k->data, entry.k.data(), entry.k.size());
+    memcpy(state->kv_cross.v->data, entry.v.data(), entry.v.size());
+    if (--entry.n_pending <= 0) {
+        share->windows.erase(it);
+    }
+    return true;
+}
+
+static void encoder_share_publish(const whisper_state *state,
+                                  uint64_t window) {
+    EncoderShare *share = g_encoder_share;
+    if (share == nullptr) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(share->mutex);
+        std::map<uint64_t, EncoderShare::Window>::iterator it =
+            share->windows.find(window);
+        if (it == share->windows.end() || it->second.ready) {
+            return;
+        }
+        EncoderShare::Window &entry = it->second;
+        if (entry.n_pending <= 0) {
+            share->windows.erase(it);
+            return;
+        }
+        const uint8_t *k = static_cast<const uint8_t *>(state->kv_cross.k->data);
+        const uint8_t *v = static_cast<const uint8_t *>(state->kv_cross.v->data);
+        entry.k.assign(k, k + ggml_nbytes(state->kv_cross.k));
+        entry.v.assign(v, v + ggml_nbytes(state->kv_cross.v));
+        entry.ready = true;
+    }
+    share->cv.notify_all();
+}
+
+// Drop what is known about a state's K/V cache, when it is freed or
+// overwritten behind the compute hook's back.
+static void encoder_cache_forget(const whisper_state *state) {
+    std::lock_guard<std::mutex> lock(g_encoder_cache_mutex);
+    g_encoder_cache.erase(state);
+}
+
+// Whether cgraph would only recompute what the current state's K/V cache
+// already holds.
+static bool encoder_cache_hit(const struct ggml_cgraph *cgraph) {
+    whisper_state *state = g_encoder_cache_state;
+    if (state == nullptr) {
+        return false;
+    }
+    const struct ggml_tensor *mel = encoder_input(cgraph);
+    if (mel == nullptr) {
+        if (g_encoder_cache_skip_cross &&
+            classify_graph(cgraph) == whisper::COMPUTE_PHASE_ENCODER) {
+            g_encoder_cache_skip_cross = false;
+            return true;
+        }
+        return false;
+    }
+
+    const uint64_t window = hash_tensor(mel);
+    {
+        std::lock_guard<std::mutex> lock(g_encoder_cache_mutex);
+        std::map<const whisper_state *, uint64_t>::iterator it =
+            g_encoder_cache.find(state);
+        if (it != g_encoder_cache.end() && it->second == window) {
+            g_encoder_cache_skip_cross = true;
+            return true;
+        }
+        // NOTE: the K/V cache is about to be overwritten
+        if (it != g_encoder_cache.end()) {
+            g_encoder_cache.erase(it);
+        }
+    }
+    if (encoder_share_fetch(state, window)) {
+        std::lock_guard<std::mutex> lock(g_encoder_cache_mutex);
+        g_encoder_cache[state] = window;
+        g_encoder_cache_skip_cross = true;
+        return true;
+    }
+    g_encoder_cache_pending = true;
+    g_encoder_cache_window = window;
+    return false;
+}
+
+static void encoder_cache_computed(const struct ggml_cgraph *cgraph) {
+    if (g_encoder_cache_state == nullptr || !g_encoder_cache_pending ||
+        encoder_input(cgraph) != nullptr ||
+        classify_graph(cgraph) != whisper::COMPUTE_PHASE_ENCODER) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(g_encoder_cache_mutex);
+        g_encoder_cache[g_encoder_cache_state] = g_encoder_cache_window;
+    }
+    g_encoder_cache_pending = false;
+    encoder_share_publish(g_encoder_cache_state, g_encoder_cache_window);
+}
+
+// Skips windows without speech (no_speech_thold). whisper.cpp keeps only
+// the logits of the last prompt token, while the no-speech probability is
+// read at the start-of-transcript token, as in OpenAI's implementation. So
+// the hook below records the tokens of every decoder graph, and at the
+// first step of a window the filter decodes the start-of-transcript token
+// again at its position in the prompt. That rewrites the same K/V entry the
+// prompt decode wrote, and yields its logits. When the no-speech token is
+// more likely than the threshold, only end of text is left to sample. An
+// empty decode counts as failed, so the fallback temperatures see the same
+// verdict (kept until the next window is encoded) and the window is skipped
+// with no segment after one step at each of them.
+struct NoSpeechFilter {
+    whisper_context *wctx = nullptr;
+    whisper_state *state = nullptr;
+    float threshold = 1.0f;
+    int n_threads = 1;
+    // tokens of the last decoder graph computed on this thread
+    std::vector<whisper_token> decoded;
+    // verdict for the current window
+    bool judged = false;
+    bool silent = false;
+
+    whisper_logits_filter_callback next = nullptr;
+    void *next_user_data = nullptr;
+
+    void install(whisper_full_params *params) {
+        threshold = params->no_speech_thold;
+        n_threads = params->n_threads;
+        next = params->logits_filter_callback;
+        next_user_data = params->logits_filter_callback_user_data;
+        params->logits_filter_callback = callback;
+        params->logits_filter_callback_user_data = this;
+    }
+
+    float no_speech_prob();
+
+    static void callback(whisper_context *ctx, whisper_state *state,
+                         const whisper_token_data *tokens, int n_tokens,
+                         float *logits, void *user_data);
+};
+
+static thread_local NoSpeechFilter *g_no_speech = nullptr;
+
+// The row ids a decoder graph looks up in table: its tokens for the token
+// embedding, their positions for the positional one. nullptr if none.
+static const struct ggml_tensor *graph_rows(const struct ggml_cgraph *cgraph,
+                                            const struct ggml_tensor *table) {
+    for (int i = 0; i < cgraph->n_nodes; ++i) {
+        const struct ggml_tensor *node = cgraph->nodes[i];
+        if (node->op == GGML_OP_GET_ROWS && node->src0 == table &&
+            node->src1->type == GGML_TYPE_I32) {
+            return node->src1;
+        }
+    }
+    return nullptr;
+}
+
+// Record the token ids fed to a decoder graph.
+static void no_speech_record(const struct ggml_cgraph *cgraph) {
+    const struct ggml_tensor *rows =
+        graph_rows(cgraph, g_no_speech->wctx->model.d_te);
+    if (rows != nullptr) {
+        const whisper_token *ids =
+            static_cast<const whisper_token *>(rows->data);
+        g_no_speech->decoded.assign(ids, ids + rows->ne[0]);
+    }
+}
+
+float NoSpeechFilter::no_speech_prob() {
+    const whisper_token sot = whisper_token_sot(wctx);
+    const std::vector<whisper_token>::const_reverse_iterator it =
+        std::find(decoded.rbegin(), decoded.rend(), sot);
+    if (it == decoded.rend()) {
+        return 0.0f;
+    }
+    const int n_past = (int)(decoded.rend() - it) - 1;
+    const int ret =
+        whisper_decode_with_state(wctx, state, &sot, 1, n_past, n_threads);
+    // the prompt is recorded again by the next window or fallback
+    decoded.clear();
+    if (ret != 0) {
+        return 0.0f;
+    }
+
+    const std::vector<float> &logits = state->logits;
+    const int n_vocab = whisper_n_vocab(wctx);
+    const float *row = logits.data() + logits.size() - n_vocab;
+    const float max = *std::max_element(row, row + n_vocab);
+    double sum = 0.0;
+    for (int i = 0; i < n_vocab; ++i) {
+        sum += std::exp(row[i] - max);
+    }
+    // NOTE: the no-speech token (<|nocaptions|>) comes right before
+    // <|notimestamps|> in both the English and multilingual vocabularies
+    const whisper_token no_speech = whisper_token_not(wctx) - 1;
+    return (float)(std::exp(row[no_speech] - max) / sum);
+}
+
+void NoSpeechFilter::callback(whisper_context *ctx, whisper_state *state,
+                              const whisper_token_data *tokens, int n_tokens,
+                              float *logits, void *user_data) {
+    NoSpeechFilter *filter = static_cast<NoSpeechFilter *>(user_data);
+    if (n_tokens == 0 && !filter->judged) {
+        filter->silent = filter->no_speech_prob() > filter->threshold;
+        filter->judged = true;
+    }
+    if (n_tokens == 0 && filter->silent) {
+        const whisper_token eot = whisper_token_eot(ctx);
+        const int n_vocab = whisper_n_vocab(ctx);
+        for (int i = 0; i < n_vocab; ++i) {
+            if (i != eot) {
+                logits[i] = -INFINITY;
+            }
+        }
+        return;
+    }
+    if (filter->next != nullptr) {
+        filter->next(ctx, state, tokens, n_tokens, logits,
+                     filter->next_user_data);
+    }
+}
+
+class ScopedNoSpeechFilter {
+  public:
+    explicit ScopedNoSpeechFilter(NoSpeechFilter *filter)
+        : m_prev(g_no_speech) {
+        g_no_speech = filter;
+    }
+    ~ScopedNoSpeechFilter() { g_no_speech = m_prev; }
+
+    ScopedNoSpeechFilter(const ScopedNoSpeechFilter &) = delete;
+    ScopedNoSpeechFilter &operator=(const ScopedNoSpeechFilter &) = delete;
+
+  private:
+    NoSpeechFilter *m_prev;
+};
+
+// Beam search patience (SamplingBeamSearch::patience, see
+// https://arxiv.org/pdf/2204.05424.pdf): decoding stops once
+// round(beam_size * patience) beams have finished. whisper.cpp decodes
+// until every beam is done, which is patience 1, so past that count the
+// beams still running are marked failed from the logits callback and left
+// out of the ranking. A beam can't finish twice in whisper.cpp, so a
+// patience above 1 decodes as 1.
+struct BeamPatience {
+    int n_beams = 0;
+    int max_finished = 0;
+
+    whisper_logits_filter_callback next = nullptr;
+    void *next_user_data = nullptr;
+
+    // Whether params stop early at all.
+    static bool applies(const whisper_full_params &params) {
+        return params.strategy == WHISPER_SAMPLING_BEAM_SEARCH &&
+               params.beam_search.beam_size > 1 &&
+               params.beam_search.patience > 0.0f &&
+               params.beam_search.patience < 1.0f;
+    }
+
+    void install(whisper_full_params *params) {
+        n_beams =
+            std::min(params->beam_search.beam_size, WHISPER_MAX_DECODERS);
+        max_finished = std::max(
+            1, (int)std::round(params->beam_search.beam_size *
+                               params->beam_search.patience));
+        next = params->logits_filter_callback;
+        next_user_data = params->logits_filter_callback_user_data;
+        params->logits_filter_callback = callback;
+        params->logits_filter_callback_user_data = this;
+    }
+
+    static void callback(whisper_context *ctx, whisper_state *state,
+                         const whisper_token_data *tokens, int n_tokens,
+                         float *logits, void *user_data) {
+        BeamPatience *patience = static_cast<BeamPatience *>(user_data);
+        // NOTE: logits is the buffer of the decoder being processed
+        whisper_decoder *beam = nullptr;
+        int n_finished = 0;
+        for (int j = 0; j < patience->n_beams; ++j) {
+            whisper_decoder &decoder = state->decoders[j];
+            if (decoder.logits.data() == logits) {
+                beam = &decoder;
+            } else if (decoder.completed) {
+                ++n_finished;
+            }
+        }
+        if (n_tokens > 0 && beam != nullptr &&
+            n_finished >= patience->max_finished) {
+            beam->failed = true;
+            return;
+        }
+        if (patience->next != nullptr) {
+            patience->next(ctx, state, tokens, n_tokens, logits,
+                           patience->next_user_data);
+        }
+    }
+};
+
+// Prompt prefill reuse. whisper_full decodes the whole prompt again at
+// every fallback temperature of a window, into the same K/V entries of the
+// first decoder, which the steps after it don't touch. So until the next
+// window is encoded, a prompt decoded again on this thread is not computed:
+// its K/V are in place already, and the logits of its last token are
+// copied from the first time. Only within a window: past the first layer
+// the K/V of the prompt depend on the audio, through cross-attention.
+struct PromptPrefill {
+    whisper_context *wctx = nullptr;
+    std::vector<whisper_token> tokens;
+    std::vector<float> logits;
+
+    // The logits tensor of a decoder graph, nullptr if it isn't one.
+    const struct ggml_tensor *output(const struct ggml_cgraph *cgraph) const {
+        const struct ggml_tensor *out = cgraph->nodes[cgraph->n_nodes - 1];
+        if (out->op != GGML_OP_MUL_MAT || out->src0 != wctx->model.d_te ||
+            out->type != GGML_TYPE_F32) {
+            return nullptr;
+        }
+        return out;
+    }
+
+    // The tokens of a decoder graph that decodes a prompt, from position 0.
+    bool prompt(const struct ggml_cgraph *cgraph,
+                std::vector<whisper_token> *out) const {
+        const struct ggml_tensor *ids = graph_rows(cgraph, wctx->model.d_te);
+        const struct ggml_tensor *pos = graph_rows(cgraph, wctx->model.d_pe);
+        if (ids == nullptr || pos == nullptr ||
+            static_cast<const int32_t *>(pos->data)[0] != 0) {
+            return false;
+        }
+        const whisper_token *data =
+            static_cast<const whisper_token *>(ids->data);
+        out->assign(data, data + ids->ne[0]);
+        return true;
+    }
+
+    // Whether cgraph decodes the recorded prompt again, in which case its
+    // logits are written to its output.
+    bool hit(const struct ggml_cgraph *cgraph) const {
+        std::vector<whisper_token> ids;
+        const struct ggml_tensor *out = output(cgraph);
+        if (tokens.empty() || out == nullptr || !prompt(cgraph, &ids) ||
+            ids != tokens || ggml_nelements(out) != (int64_t)logits.size()) {
+            return false;
+        }
+        memcpy(out->data, logits.data(), logits.size() * sizeof(float));
+        return true;
+    }
+
+    void computed(const struct ggml_cgraph *cgraph) {
+        const struct ggml_tensor *out = output(cgraph);
+        if (out != nullptr && prompt(cgraph, &tokens)) {
+            const float *data = static_cast<const float *>(out->data);
+            logits.assign(data, data + ggml_nelements(out));
+        }
+    }
+};
+
+static thread_local PromptPrefill *g_prompt_prefill = nullptr;
+
+class ScopedPromptPrefill {
+  public:
+    explicit ScopedPromptPrefill(PromptPrefill *prefill)
+        : m_prev(g_prompt_prefill) {
+        g_prompt_prefill = prefill;
+    }
+    ~ScopedPromptPrefill() { g_prompt_prefill = m_prev; }
+
+    ScopedPromptPrefill(const ScopedPromptPrefill &) = delete;
+    ScopedPromptPrefill &operator=(const ScopedPromptPrefill &) = delete;
+
+  private:
+    PromptPrefill *m_prev;
+};
+
+static void whisper_cpp2py_graph_compute(struct ggml_context *ctx,
+                                         struct ggml_cgraph *cgraph) {
+    if ((g_no_speech != nullptr || g_prompt_prefill != nullptr) &&
+        classify_graph(cgraph) == whisper::COMPUTE_PHASE_ENCODER) {
+        if (g_no_speech != nullptr) {
+            g_no_speech->judged = false;
+        }
+        if (g_prompt_prefill != nullptr) {
+            g_prompt_prefill->tokens.clear();
+        }
+    }
+    if (encoder_cache_hit(cgraph)) {
+        return;
+    }
+
+    // NOTE: threads we did not start (e.g. the workers of
+    // whisper_full_parallel) have no lease, and only count against the CPU
+    // budget while computing.
+    std::unique_ptr<whisper::CpuLease> transient;
+    if (whisper::CpuLease::current() == nullptr) {
+        transient.reset(new whisper::CpuLease(cgraph->n_threads));
+    }
+    const whisper::ComputePhase phase = classify_graph(cgraph);
+    int n_threads = whisper::CpuLease::current()->threads(phase);
+    if (g_no_speech != nullptr && phase == whisper::COMPUTE_PHASE_DECODER) {
+        no_speech_record(cgraph);
+    }
+    if (g_prompt_prefill != nullptr &&
+        phase == whisper::COMPUTE_PHASE_DECODER &&
+        g_prompt_prefill->hit(cgraph)) {
+        return;
+    }
+
+    // Pipelined requests move each graph to the core group of its phase,
+    // decoder graphs to the request's own slice of the decoder group. An
+    // encoder graph holds a turn on the whole encoder group.
+    whisper::PipelineStages *stages = whisper::PipelineStages::current();
+    std::unique_ptr<whisper::PipelineStages::EncoderTurn> turn;
+    std::unique_ptr<whisper::ScopedCpuSet> group;
+    if (stages != nullptr) {
+        if (phase == whisper::COMPUTE_PHASE_ENCODER) {
+            turn.reset(new whisper::PipelineStages::EncoderTurn(*stages));
+            n_threads = std::max(1, (int)stages->cpus(phase).size() /
+                                        stages->encoder_slots());
+        }
+        group.reset(new whisper::ScopedCpuSet(stages->current_cpus(phase)));
+    }
+
+    const std::vector<int> *cpus = whisper::ScopedCpuSet::current();
+    if (cpus != nullptr) {
+        n_threads = std::min(n_threads, (int)cpus->size());
+    }
+    cgraph->n_threads = n_threads;
+
+    ggml_graph_compute(ctx, cgraph);
+    encoder_cache_computed(cgraph);
+    if (g_prompt_prefill != nullptr &&
+        phase == whisper::COMPUTE_PHASE_DECODER) {
+        g_prompt_prefill->computed(cgraph);
+    }
+}
+
+whisper_state *Context::current_state() {
+    if (init_with_state) {
+        return wctx != nullptr ? wctx->state : nullptr;
+    }
+    return wstate;
+}
+
+// Replace a K/V cache whisper_init_state made with one holding f16, sized
+// as for an f16 model.
+static void kv_cache_to_f16(whisper_context *wctx, whisper_kv_cache *cache,
+                            size_t mem_bytes, int n_ctx) {
+    kv_cache_free(*cache);
+    // NOTE: kv_cache_init resizes buf in place, which keeps its capacity
+    std::vector<uint8_t>().swap(cache->buf);
+    if (!kv_cache_init(wctx->model.hparams, mem_bytes, *cache, GGML_TYPE_F16,
+                       n_ctx)) {
+        RAISE_RUNTIME_ERROR("Failed to allocate the f16 K/V cache.");
+    }
+}
+
+void Context::init_state(int numa_node, bool kv_f16) {
     RAISE_IF_NULL(wctx);
-    this->set_state(whisper_init_state(wctx));
+    // NOTE: whisper_init_state zero-fills the KV caches and compute buffers,
+    // so creating it from a thread bound to the node first-touches them
+    // there.
+    whisper::ScopedNumaNode bind(numa_node);
+    whisper_state *state = whisper_init_state(wctx);
+    RAISE_IF_NULL(state);
+    // the caches of an f16 model hold f16 already, and ggml converts
+    // between the two in the copies and products that use them
+    if (kv_f16 && wctx->wtype == GGML_TYPE_F32) {
+        const e_model type = wctx->model.type;
+        kv_cache_to_f16(wctx, &state->decoders[0].kv_self,
+                        MEM_REQ_KV_SELF.at(type),
+                        wctx->model.hparams.n_text_ctx);
+        kv_cache_to_f16(wctx, &state->kv_cross, MEM_REQ_KV_CROSS.at(type),
+                        wctx->model.hparams.n_audio_ctx);
+    }
+    this->set_state(state);
+    this->numa_node = numa_node;
+    this->kv_f16 = kv_f16;
+}
+
+Context Context::clone_with_state(int numa_node) {
+    RAISE_IF_NULL(wctx);
+    Context c;
+    c.set_context(wctx);
+    c.init_state(numa_node, kv_f16);
+    c.transcription_cache = transcription_cache;
+    c.cached_model_hash = cached_model_hash;
+    return c;
 }
 
 Context Context::from_file(const char *filename, bool no_state) {
@@ -85,11 +744,52 @@ Context Context::from_buffer(void *buffer, size_t buffer_size, bool no_state) {
 }
 
 void Context::free_state() {
+    encoder_cache_forget(wstate);
     whisper_free_state(wstate);
     this->set_state(nullptr);
+    this->numa_node = -1;
+}
+
+template <typename T> static size_t release_buffer(std::vector<T> *buffer) {
+    const size_t size = buffer->capacity() * sizeof(T);
+    std::vector<T>().swap(*buffer);
+    return size;
+}
+
+size_t Context::trim_state() {
+    whisper_state *state = current_state();
+    RAISE_IF_NULL(state);
+    size_t freed = 0;
+    // NOTE: whisper_full allocates the K/V caches of the decoders past the
+    // first one when best_of or beam search first needs them, and keeps
+    // them. It allocates them again for a decoder whose cache has no ggml
+    // context.
+    for (int j = 1; j < WHISPER_MAX_DECODERS; ++j) {
+        whisper_decoder &decoder = state->decoders[j];
+        if (decoder.kv_self.ctx == nullptr) {
+            continue;
+        }
+        kv_cache_free(decoder.kv_self);
+        decoder.kv_self.ctx = nullptr;
+        decoder.kv_self.k = nullptr;
+        decoder.kv_self.v = nullptr;
+        decoder.kv_self.n = 0;
+        freed += release_buffer(&decoder.kv_self.buf);
+        freed += release_buffer(&decoder.probs);
+        freed += release_buffer(&decoder.logits);
+        freed += release_buffer(&decoder.logprobs);
+    }
+    // the spectrogram of the last call, 1 MB per 30s of audio
+    freed += release_buffer(&state->mel.data);
+    state->mel.n_len = 0;
+    spectrogram_initialized = false;
+    return freed;
 }
 
 void Context::free() {
+    if (wctx != nullptr) {
+        encoder_cache_forget(wctx->state);
+    }
     whisper_free(wctx);
     this->set_context(nullptr);
     this->free_state();
@@ -105,6 +805,10 @@ void Context::pc_to_mel(std::vector<float> &pcm, size_t threads,
     if (threads < 1)
         RAISE_RUNTIME_ERROR("threads must be >= 1");
 
+    whisper::CpuLease lease(threads);
+    whisper::ScopedNumaNode bind(numa_node);
+    threads = lease.threads();
+
     int res;
 
     if (phase_vocoder && !init_with_state) {
@@ -164,6 +868,10 @@ void Context::encode(size_t offset, size_t threads) {
     }
     if (threads < 1)
         throw std::invalid_argument("threads must be >= 1");
+    whisper::CpuLease lease(threads);
+    whisper::ScopedNumaNode bind(numa_node);
+    // NOTE: always encodes, the caller may be timing the encoder
+    encoder_cache_forget(current_state());
     int res;
 
     if (!init_with_state) {
@@ -194,6 +902,8 @@ void Context::decode(std::vector<whisper_token> *token, size_t n_past,
     if (threads < 1)
         throw std::invalid_argument("threads must be >= 1");
 
+    whisper::CpuLease lease(threads);
+    whisper::ScopedNumaNode bind(numa_node);
     int res;
 
     if (!init_with_state) {
@@ -220,16 +930,15 @@ void Context::decode(std::vector<whisper_token> *token, size_t n_past,
 // from previous decoder calls. Returns vec<whisper_token> on success.
 std::vector<whisper_token> Context::tokenize(std::string *text,
                                              size_t max_tokens) {
-    std::vector<whisper_token> tokens;
-    tokens.reserve(max_tokens);
+    // NOTE: sized, not just reserved, whisper_tokenize writes into it
+    std::vector<whisper_token> tokens(max_tokens);
 
     int ret = whisper_tokenize(wctx, text->c_str(), tokens.data(), max_tokens);
 
     if (ret == -1) {
         RAISE_RUNTIME_ERROR("Too many results tokens.");
     } else {
-        // ret != -1 then length of the vector is at least ret tokens
-        tokens.reserve(ret);
+        tokens.resize(ret);
     }
     return tokens;
 };
@@ -261,9 +970,15 @@ std::vector<float> Context::lang_detect(size_t offset_ms, size_t threads) {
     if (threads < 1)
         throw std::invalid_argument("threads must be >= 1");
 
+    whisper::CpuLease lease(threads);
+    whisper::ScopedNumaNode bind(numa_node);
+    // the window is kept for a full() right after, which transcribes it
+    ScopedEncoderCache cache(current_state(), true);
     int res;
 
-    std::vector<float> lang_probs(whisper_lang_max_id());
+    // NOTE: whisper_lang_auto_detect writes one probability per language id,
+    // 0 through whisper_lang_max_id() inclusive
+    std::vector<float> lang_probs(whisper_lang_max_id() + 1);
 
     if (!init_with_state) {
         RAISE_IF_NULL(wstate);
@@ -293,6 +1008,89 @@ std::vector<float> Context::lang_detect(size_t offset_ms, size_t threads) {
     }
 }
 
+std::vector<float>
+Context::lang_detect_batch(std::vector<std::vector<float>> &clips,
+                           int n_states, int threads, int audio_ctx) {
+    RAISE_IF_NULL(wctx);
+    if (n_states < 1 || threads < 1) {
+        throw std::invalid_argument("n_states and threads must be >= 1");
+    }
+    const int n_audio_ctx = wctx->model.hparams.n_audio_ctx;
+    if (audio_ctx < 0 || audio_ctx > n_audio_ctx) {
+        throw std::invalid_argument(
+            STREAM_CAST(std::stringstream()
+                        << "audio_ctx must be between 0 and " << n_audio_ctx)
+                .str());
+    }
+    for (size_t i = 0; i < clips.size(); ++i) {
+        if (clips[i].size() < WHISPER_N_FFT) {
+            throw std::invalid_argument(
+                STREAM_CAST(std::stringstream()
+                            << "clip " << i << " is shorter than "
+                            << WHISPER_N_FFT << " samples")
+                    .str());
+        }
+    }
+
+    const size_t n_langs = whisper_lang_max_id() + 1;
+    std::vector<float> probs(clips.size() * n_langs);
+    n_states = std::min<int>(n_states, (int)clips.size());
+
+    std::vector<Context> states;
+    for (int i = 0; i < n_states; ++i) {
+        states.push_back(clone_with_state(numa_node));
+    }
+
+    // clips are handed out one at a time, so short and long ones balance
+    std::atomic<size_t> next{0};
+    std::vector<std::exception_ptr> errors(n_states);
+    const auto run = [&](int worker) {
+        Context &context = states[worker];
+        try {
+            for (size_t i = next++; i < clips.size(); i = next++) {
+                std::vector<float> &pcm = clips[i];
+                context.pc_to_mel(pcm, threads, false);
+
+                // Only encode the frames the clip covers. The conv stem
+                // halves the mel frames, round up to a multiple of 64.
+                int n_ctx = audio_ctx;
+                if (n_ctx == 0) {
+                    const int n_frames = (int)(pcm.size() / WHISPER_HOP_LENGTH);
+                    n_ctx = std::min(n_audio_ctx, ((n_frames + 1) / 2 + 63) /
+                                                      64 * 64);
+                }
+                context.wstate->exp_n_audio_ctx =
+                    n_ctx == n_audio_ctx ? 0 : n_ctx;
+
+                const std::vector<float> row = context.lang_detect(0, threads);
+                std::copy(row.begin(), row.end(), probs.begin() + i * n_langs);
+            }
+        } catch (...) {
+            errors[worker] = std::current_exception();
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (int i = 1; i < n_states; ++i) {
+        workers.emplace_back(run, i);
+    }
+    if (n_states > 0) {
+        run(0);
+    }
+    for (std::thread &worker : workers) {
+        worker.join();
+    }
+    for (Context &state : states) {
+        state.free_state();
+    }
+    for (const std::exception_ptr &error : errors) {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+    return probs;
+}
+
 // Get mel spectrogram length
 size_t Context::n_len() {
     if (!init_with_state) {
@@ -312,6 +1110,87 @@ size_t Context::n_audio_ctx() { return whisper_n_audio_ctx(wctx); }
 // check if the model is multilingual
 bool Context::is_multilingual() { return whisper_is_multilingual(wctx) != 0; }
 
+std::string Context::model_id() {
+    RAISE_IF_NULL(wctx);
+    const whisper_hparams &hparams = wctx->model.hparams;
+    std::stringstream ss;
+    ss << "n_vocab:" << hparams.n_vocab << ",n_audio_state:"
+       << hparams.n_audio_state << ",n_audio_layer:" << hparams.n_audio_layer
+       << ",n_text_state:" << hparams.n_text_state
+       << ",n_text_layer:" << hparams.n_text_layer << ",f16:" << hparams.f16;
+    return ss.str();
+}
+
+// Number of audio frames the cross-attention K/V are laid out for, which
+// the decoder reads back with the same stride.
+static int encoder_output_ctx(const whisper_context *wctx,
+                              const whisper_state *state) {
+    return state->exp_n_audio_ctx > 0 ? state->exp_n_audio_ctx
+                                      : wctx->model.hparams.n_audio_ctx;
+}
+
+static py::dtype kv_dtype(const struct ggml_tensor *tensor) {
+    return py::dtype(tensor->type == GGML_TYPE_F16 ? "float16" : "float32");
+}
+
+// Cross-attention K and V computed from the last encoded window: the part
+// of the encoder output the decoder reads. Zero-copy views into the state,
+// kept alive by owner and valid until the state is encoded again or freed.
+std::pair<py::array, py::array> Context::get_encoder_output(py::handle owner) {
+    if (!encode_completed) {
+        RAISE_RUNTIME_ERROR("encode not completed.");
+    }
+    whisper_state *state = current_state();
+    RAISE_IF_NULL(state);
+
+    const whisper_hparams &hparams = wctx->model.hparams;
+    const struct ggml_tensor *k = state->kv_cross.k;
+    const struct ggml_tensor *v = state->kv_cross.v;
+    const std::vector<ssize_t> shape = {
+        hparams.n_text_layer, encoder_output_ctx(wctx, state),
+        hparams.n_text_state};
+    return std::make_pair(py::array(kv_dtype(k), shape, k->data, owner),
+                          py::array(kv_dtype(v), shape, v->data, owner));
+}
+
+// Load K and V returned by get_encoder_output into the state, after which
+// decode() can run without encode().
+void Context::set_encoder_output(py::array k, py::array v) {
+    whisper_state *state = current_state();
+    RAISE_IF_NULL(state);
+
+    const whisper_hparams &hparams = wctx->model.hparams;
+    const py::array *inputs[] = {&k, &v};
+    struct ggml_tensor *targets[] = {state->kv_cross.k, state->kv_cross.v};
+    for (int i = 0; i < 2; ++i) {
+        const py::array &input = *inputs[i];
+        if (input.ndim() != 3 || input.shape(0) != hparams.n_text_layer ||
+            input.shape(1) < 1 || input.shape(1) > hparams.n_audio_ctx ||
+            input.shape(2) != hparams.n_text_state ||
+            input.shape(1) != k.shape(1)) {
+            throw std::invalid_argument(
+                "encoder output must have shape (n_text_layer, n_ctx, "
+                "n_text_state) with n_ctx <= n_audio_ctx");
+        }
+        if (input.dtype().kind() != 'f' ||
+            input.itemsize() != (ssize_t)ggml_element_size(targets[i]) ||
+            !(input.flags() & py::array::c_style)) {
+            throw std::invalid_argument(
+                "encoder output must be a C-contiguous array of the same "
+                "dtype as get_encoder_output()");
+        }
+    }
+
+    // NOTE: the K/V cache no longer matches the window it was encoded from
+    encoder_cache_forget(state);
+    const int n_ctx = (int)k.shape(1);
+    state->exp_n_audio_ctx = n_ctx == hparams.n_audio_ctx ? 0 : n_ctx;
+    for (int i = 0; i < 2; ++i) {
+        memcpy(targets[i]->data, inputs[i]->data(), inputs[i]->nbytes());
+    }
+    encode_completed = true;
+}
+
 // Token logits obtained from the last call to whisper_decode()
 // The logits for the last token are stored in the last row
 // Rows: n_tokens
@@ -356,12 +1235,285 @@ std::string Context::token_to_str(whisper_token token_id) {
     return std::string(ret);
 }
 
+// Whether the result of whisper_full with these params depends on nothing
+// but the audio, the params and the model.
+static bool transcription_cacheable(const whisper_full_params &params,
+                                    const whisper_state *state) {
+    // a logits filter changes the text in ways the params do not show, and
+    // encoder_begin_callback can stop a run half way
+    if (params.logits_filter_callback != nullptr ||
+        params.encoder_begin_callback != nullptr) {
+        return false;
+    }
+    // otherwise the text decoded by the previous call is part of the prompt
+    return params.no_context || state->prompt_past.empty();
+}
+
+// Hash of the model: its shape, and the learned decoder positional
+// embedding, which tells apart fine-tunes of the same size.
+static uint64_t model_hash(whisper_context *wctx, const std::string &id) {
+    uint64_t h = whisper::hash_bytes(id.data(), id.size());
+    const ggml_tensor *d_pe = wctx->model.d_pe;
+    if (d_pe != nullptr && d_pe->data != nullptr) {
+        h = whisper::hash_bytes(d_pe->data, ggml_nbytes(d_pe), h);
+    }
+    return h;
+}
+
+static whisper::CachedTranscript capture_transcript(const whisper_state *state) {
+    whisper::CachedTranscript out;
+    out.lang_id = state->lang_id;
+    out.prompt_past = state->prompt_past;
+    out.segments.reserve(state->result_all.size());
+    for (const whisper_segment &segment : state->result_all) {
+        whisper::CachedSegment cached;
+        cached.t0 = segment.t0;
+        cached.t1 = segment.t1;
+        cached.text = segment.text;
+        cached.tokens = segment.tokens;
+        out.segments.push_back(std::move(cached));
+    }
+    return out;
+}
+
+static void restore_transcript(whisper_state *state,
+                               whisper::CachedTranscript &transcript) {
+    state->lang_id = transcript.lang_id;
+    state->prompt_past = std::move(transcript.prompt_past);
+    state->result_all.clear();
+    state->result_all.reserve(transcript.segments.size());
+    for (whisper::CachedSegment &cached : transcript.segments) {
+        whisper_segment segment;
+        segment.t0 = cached.t0;
+        segment.t1 = cached.t1;
+        segment.text = std::move(cached.text);
+        segment.tokens = std::move(cached.tokens);
+        state->result_all.push_back(std::move(segment));
+    }
+}
+
+// Speculative temperature fallback (Params::with_speculative_fallback).
+// Run k of a race decodes from the k-th fallback temperature on a state of
+// its own, all runs at once and sharing the encoder output. A run other
+// than the last that has to fall back is out, and the lowest run finishing
+// without falling back wins, which is the temperature whisper.cpp would
+// have settled on after trying the ones below it in turn. Runs above a
+// winner are cancelled. The last run falls back as usual, so a race always
+// has a winner.
+struct FallbackRace {
+    explicit FallbackRace(int n_runs)
+        : cancelled(n_runs), clean(n_runs, false) {}
+
+    std::vector<std::atomic<bool>> cancelled;
+    std::mutex mutex;
+    std::vector<bool> clean;
+
+    // Run index is done, clean if it never fell back nor was cancelled.
+    void finish(int index, bool done_clean) {
+        if (!done_clean) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        clean[index] = true;
+        for (size_t i = index + 1; i < cancelled.size(); ++i) {
+            cancelled[i] = true;
+        }
+    }
+
+    int winner() {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (size_t i = 0; i < clean.size(); ++i) {
+            if (clean[i]) {
+                return (int)i;
+            }
+        }
+        return (int)clean.size() - 1;
+    }
+};
+
+struct FallbackRun {
+    FallbackRace *race = nullptr;
+    int index = 0;
+    float temperature = 0.0f;
+    bool last = false;
+    // decoding attempts in the current window
+    int attempts = 0;
+    bool out = false;
+
+    whisper_logits_filter_callback next = nullptr;
+    void *next_user_data = nullptr;
+    whisper_encoder_begin_callback next_encoder_begin = nullptr;
+    void *next_encoder_begin_user_data = nullptr;
+
+    bool stopped() const { return out || race->cancelled[index]; }
+
+    void install(whisper_full_params *params) {
+        params->temperature = temperature;
+        next = params->logits_filter_callback;
+        next_user_data = params->logits_filter_callback_user_data;
+        params->logits_filter_callback = callback;
+        params->logits_filter_callback_user_data = this;
+        next_encoder_begin = params->encoder_begin_callback;
+        next_encoder_begin_user_data = params->encoder_begin_callback_user_data;
+        params->encoder_begin_callback = encoder_begin;
+        params->encoder_begin_callback_user_data = this;
+    }
+
+    // A stopped run encodes no further window.
+    static bool encoder_begin(whisper_context *ctx, whisper_state *state,
+                              void *user_data) {
+        FallbackRun *run = static_cast<FallbackRun *>(user_data);
+        run->attempts = 0;
+        if (run->stopped()) {
+            return false;
+        }
+        return run->next_encoder_begin == nullptr ||
+               run->next_encoder_begin(ctx, state,
+                                       run->next_encoder_begin_user_data);
+    }
+
+    // Every attempt at a window starts with a step without tokens. A
+    // stopped run only gets end of text to sample, which ends its current
+    // attempt, and any left, at the next step.
+    static void callback(whisper_context *ctx, whisper_state *state,
+                         const whisper_token_data *tokens, int n_tokens,
+                         float *logits, void *user_data) {
+        FallbackRun *run = static_cast<FallbackRun *>(user_data);
+        if (n_tokens == 0 && ++run->attempts > 1 && !run->last) {
+            run->out = true;
+        }
+        if (run->stopped()) {
+            const whisper_token eot = whisper_token_eot(ctx);
+            const int n_vocab = whisper_n_vocab(ctx);
+            for (int i = 0; i < n_vocab; ++i) {
+                if (i != eot) {
+                    logits[i] = -INFINITY;
+                }
+            }
+            return;
+        }
+        if (run->next != nullptr) {
+            run->next(ctx, state, tokens, n_tokens, logits,
+                      run->next_user_data);
+        }
+    }
+};
+
+static thread_local FallbackRun *g_fallback_run = nullptr;
+
+class ScopedFallbackRun {
+  public:
+    explicit ScopedFallbackRun(FallbackRun *run) : m_prev(g_fallback_run) {
+        g_fallback_run = run;
+    }
+    ~ScopedFallbackRun() { g_fallback_run = m_prev; }
+
+    ScopedFallbackRun(const ScopedFallbackRun &) = delete;
+    ScopedFallbackRun &operator=(const ScopedFallbackRun &) = delete;
+
+  private:
+    FallbackRun *m_prev;
+};
+
+// Number of runs to race params over n_samples of audio, 1 for none.
+static int fallback_race_runs(const ParamsSnapshot &params,
+                              size_t n_samples) {
+    const whisper_full_params &fp = params.get();
+    if (params.get_speculative_fallback() <= 0 || fp.temperature_inc <= 0.0f) {
+        return 1;
+    }
+    int64_t n_window =
+        (int64_t)n_samples - (int64_t)fp.offset_ms * WHISPER_SAMPLE_RATE / 1000;
+    if (fp.duration_ms > 0) {
+        n_window = std::min(n_window, (int64_t)fp.duration_ms *
+                                          WHISPER_SAMPLE_RATE / 1000);
+    }
+    if (n_window > (int64_t)WHISPER_CHUNK_SIZE * WHISPER_SAMPLE_RATE) {
+        return 1;
+    }
+    // same temperatures whisper_full falls back through
+    int n_temperatures = 0;
+    for (float t = fp.temperature; t < 1.0f + 1e-6f; t += fp.temperature_inc) {
+        ++n_temperatures;
+    }
+    return std::max(
+        1, std::min(n_temperatures, params.get_speculative_fallback() + 1));
+}
+
+void Context::full_race(const ParamsSnapshot &params,
+                        const std::vector<float> &data, int n_runs) {
+    const whisper_full_params &fp = params.get();
+    FallbackRace race(n_runs);
+    std::vector<FallbackRun> runs(n_runs);
+    for (int i = 0; i < n_runs; ++i) {
+        runs[i].race = &race;
+        runs[i].index = i;
+        runs[i].temperature = fp.temperature + i * fp.temperature_inc;
+        runs[i].last = i == n_runs - 1;
+    }
+
+    EncoderShare share(n_runs);
+    std::vector<Context> states;
+    for (int i = 1; i < n_runs; ++i) {
+        states.push_back(clone_with_state(numa_node));
+        // every run starts from the text this state decoded last
+        states.back().current_state()->prompt_past =
+            current_state()->prompt_past;
+    }
+
+    std::vector<std::exception_ptr> errors(n_runs);
+    const auto run = [&](int i) {
+        Context &context = i == 0 ? *this : states[i - 1];
+        try {
+            ScopedEncoderShare share_scope(&share);
+            ScopedFallbackRun run_scope(&runs[i]);
+            context.full(params, data);
+            race.finish(i, !runs[i].stopped());
+        } catch (...) {
+            errors[i] = std::current_exception();
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (int i = 1; i < n_runs; ++i) {
+        threads.emplace_back(run, i);
+    }
+    run(0);
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+
+    // NOTE: sequential fallback would have raised the error of the first
+    // temperature to fail before reaching the winner's. Runs past the
+    // winner were cancelled, and what they raised is of no interest.
+    const int winner = race.winner();
+    std::exception_ptr error;
+    for (int i = 0; i <= winner && !error; ++i) {
+        error = errors[i];
+    }
+    if (winner > 0 && !error) {
+        whisper::CachedTranscript transcript =
+            capture_transcript(states[winner - 1].current_state());
+        restore_transcript(current_state(), transcript);
+    }
+    for (Context &state : states) {
+        state.free_state();
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
 // Run the entire model:
 // PCM -> log mel spectrogram -> encoder -> decoder -> text
 //
 // Uses the specified decoding strategy to obtain the text. This is
 // usually the only function you need to call as an end user.
 int Context::full(Params params, std::vector<float> data) {
+    return full(ParamsSnapshot(params), std::move(data));
+}
+
+int Context::full(const ParamsSnapshot &params, std::vector<float> data) {
     if (wctx == nullptr) {
         RAISE_RUNTIME_ERROR("context is not initialized (due to "
                             "either 'free()' is called or "
@@ -369,15 +1521,109 @@ int Context::full(Params params, std::vector<float> data) {
                             "to initialize with 'from_file' "
                             "or 'from_buffer' and try again.");
     }
+    if (!init_with_state) {
+        RAISE_IF_NULL(wstate);
+    }
+    // NOTE: whatever returns below, nothing is reused past this call
+    ScopedEncoderCache cache(current_state(), false);
+
+    // NOTE: the callbacks get this context through containers on our stack,
+    // so params itself is never written to
+    CallbackAndContext<Params::NewSegmentCallback>::Container new_segment;
+    CallbackAndContext<Params::ProgressCallback>::Container progress;
+    whisper_full_params fp = params.bind(*this, &new_segment, &progress);
+    whisper::LogitsFilterChain logits_filter;
+    if (params.get_logits_processor() != nullptr) {
+        logits_filter.install(*params.get_logits_processor(), wctx, &fp);
+    }
+    BeamPatience patience;
+    if (BeamPatience::applies(fp)) {
+        patience.install(&fp);
+    }
+    // NOTE: installed last so it runs first, and skips the other filters
+    // on silent windows
+    NoSpeechFilter no_speech;
+    if (fp.no_speech_thold < 1.0f) {
+        no_speech.wctx = wctx;
+        no_speech.state = current_state();
+        no_speech.install(&fp);
+    }
+    ScopedNoSpeechFilter no_speech_scope(fp.no_speech_thold < 1.0f ? &no_speech
+                                                                   : nullptr);
+    // a run of a race (see full_race) reports nothing itself, only the
+    // caller of the race reports the winner's segments
+    FallbackRun *race_run = g_fallback_run;
+    g_fallback_run = nullptr;
+    if (race_run != nullptr) {
+        fp.new_segment_callback = nullptr;
+        fp.progress_callback = nullptr;
+        race_run->install(&fp);
+    }
 
-    Params copy = params.copy_for_full(*this);
+    whisper::CacheKey key;
+    // NOTE: the logits processor is part of the params hash, only a raw
+    // logits filter callback set by the caller bypasses the cache
+    const bool cached =
+        race_run == nullptr && transcription_cache &&
+        transcription_cacheable(params.get(), current_state());
+    if (cached) {
+        key.audio =
+            whisper::hash_bytes(data.data(), data.size() * sizeof(float));
+        key.n_samples = data.size();
+        // NOTE: hashing the model reads a whole tensor, do it once
+        if (cached_model_hash == 0) {
+            cached_model_hash = model_hash(wctx, model_id());
+        }
+        key.params = params.decoding_hash();
+        // an f16 K/V cache on an f32 model changes the numerics, see
+        // init_state
+        const uint8_t kv_f16_cache = kv_f16 && wctx->wtype == GGML_TYPE_F32;
+        key.model = whisper::hash_bytes(&kv_f16_cache, sizeof(kv_f16_cache),
+                                        cached_model_hash);
+        whisper::CachedTranscript transcript;
+        if (transcription_cache->get(key, &transcript)) {
+            whisper_state *state = current_state();
+            restore_transcript(state, transcript);
+            if (!state->result_all.empty()) {
+                fp.new_segment_callback(wctx, state,
+                                        (int)state->result_all.size(),
+                                        fp.new_segment_callback_user_data);
+            }
+            return 0;
+        }
+    }
+
+    // NOTE: the runs of a race take leases of their own
+    const int n_runs =
+        race_run == nullptr ? fallback_race_runs(params, data.size()) : 1;
+    if (n_runs > 1) {
+        full_race(params, data, n_runs);
+        whisper_state *state = current_state();
+        if (!state->result_all.empty()) {
+            fp.new_segment_callback(wctx, state,
+                                    (int)state->result_all.size(),
+                                    fp.new_segment_callback_user_data);
+        }
+        if (cached) {
+            transcription_cache->put(key, capture_transcript(state));
+        }
+        return 0;
+    }
+
+    whisper::CpuLease lease(fp.n_threads, params.get_encoder_threads(),
+                            params.get_decoder_threads());
+    whisper::ScopedNumaNode bind(params.get_numa_node() >= 0
+                                     ? params.get_numa_node()
+                                     : numa_node);
+    PromptPrefill prefill;
+    prefill.wctx = wctx;
+    ScopedPromptPrefill prefill_scope(&prefill);
     int ret;
 
     if (init_with_state) {
-        ret = whisper_full(wctx, *copy.get(), data.data(), data.size());
+        ret = whisper_full(wctx, fp, data.data(), data.size());
     } else {
-        RAISE_IF_NULL(wstate);
-        ret = whisper_full_with_state(wctx, wstate, *copy.get(), data.data(),
+        ret = whisper_full_with_state(wctx, wstate, fp, data.data(),
                                       data.size());
     }
 
@@ -392,16 +1638,18 @@ int Context::full(Params params, std::vector<float> data) {
         RAISE_RUNTIME_ERROR(
             STREAM_CAST(std::stringstream()
                         << "audio_ctx is larger than maximum allowed ("
-                        << std::to_string(params.get()->audio_ctx) << " > "
+                        << std::to_string(fp.audio_ctx) << " > "
                         << this->n_audio_ctx() << ").")
                 .str());
     } else if (ret == -6) {
         RAISE_RUNTIME_ERROR("Failed to encode.");
     } else if (ret == -7 || ret == -8) {
         RAISE_RUNTIME_ERROR("Failed to decode.");
-    } else {
-        return ret;
     }
+    if (cached && ret == 0) {
+        transcription_cache->put(key, capture_transcript(current_state()));
+    }
+    return ret;
 };
 
 // Split the input audio in chunks and process each chunk separately using
@@ -425,7 +1673,18 @@ int Context::full_parallel(Params params, std::vector<float> data,
     }
 
     Params copy = params.copy_for_full(*this);
-    int ret = whisper_full_parallel(wctx, *copy.get(), data.data(), data.size(),
+    whisper_full_params fp = *copy.get();
+    whisper::LogitsFilterChain logits_filter;
+    if (copy.logits_processor && !copy.logits_processor->empty()) {
+        logits_filter.install(*copy.logits_processor, wctx, &fp);
+    }
+    BeamPatience patience;
+    if (BeamPatience::applies(fp)) {
+        patience.install(&fp);
+    }
+    // NOTE: the first chunk overwrites this state's K/V cache
+    encoder_cache_forget(current_state());
+    int ret = whisper_full_parallel(wctx, fp, data.data(), data.size(),
                                     num_processor);
 
     if (ret == -1) {
@@ -451,6 +1710,66 @@ int Context::full_parallel(Params params, std::vector<float> data,
     }
 };
 
+std::vector<std::vector<Context::Segment>>
+Context::full_multi(std::vector<Params> variants, std::vector<float> data) {
+    RAISE_IF_NULL(wctx);
+    if (variants.empty()) {
+        return {};
+    }
+    if (!init_with_state) {
+        RAISE_IF_NULL(wstate);
+    }
+
+    EncoderShare share((int)variants.size());
+    std::vector<Context> states;
+    for (size_t i = 1; i < variants.size(); ++i) {
+        states.push_back(clone_with_state(numa_node));
+    }
+
+    std::vector<std::vector<Segment>> results(variants.size());
+    std::vector<std::exception_ptr> errors(variants.size());
+    const auto run = [&](size_t i) {
+        Context &context = i == 0 ? *this : states[i - 1];
+        try {
+            ScopedEncoderShare scope(&share);
+            context.full(variants[i], data);
+            results[i] = context.full_segments();
+        } catch (...) {
+            errors[i] = std::current_exception();
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < variants.size(); ++i) {
+        threads.emplace_back(run, i);
+    }
+    run(0);
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+    for (Context &state : states) {
+        state.free_state();
+    }
+    for (const std::exception_ptr &error : errors) {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+    return results;
+}
+
+std::vector<Context::Segment> Context::full_segments() {
+    const int n_segments = full_n_segments();
+    std::vector<Segment> segments;
+    segments.reserve(n_segments);
+    for (int i = 0; i < n_segments; ++i) {
+        segments.push_back(Segment(full_get_segment_t0(i),
+                                   full_get_segment_t1(i),
+                                   full_get_segment_text(i)));
+    }
+    return segments;
+}
+
 // Number of generated text segments
 // A segment can be a few words, a sentence, or even a paragraph.
 int Context::full_n_segments() {
@@ -580,14 +1899,22 @@ void ExportContextApi(py::module &m) {
                                             no_state);
             },
             "buffer"_a, "no_state"_a = false, py::keep_alive<0, 1>())
-        .def("init_state", &Context::init_state,
+        .def("init_state", &Context::init_state, "numa_node"_a = -1,
+             "kv_f16"_a = false,
              py::return_value_policy::take_ownership, py::keep_alive<0, 1>())
         // free will delete the context, hence the take_ownership
         .def("free", &Context::free)
+        .def("trim_state", &Context::trim_state)
         .def("pc_to_mel", &Context::pc_to_mel, "pcm"_a, "threads"_a = 1,
              "phase_vocoder"_a = false)
         .def("set_mel", &Context::set_mel, "mel"_a)
         .def("encode", &Context::encode, "offset"_a, "threads"_a = 1)
+        .def("get_encoder_output",
+             [](py::object self) {
+                 return self.cast<Context *>()->get_encoder_output(self);
+             })
+        .def("set_encoder_output", &Context::set_encoder_output, "k"_a,
+             "v"_a)
         .def("decode", &Context::decode, "tokens"_a, "n_past"_a,
              "threads"_a = 1)
         .def("tokenize", &Context::tokenize, "text"_a, "max_tokens"_a)
@@ -595,6 +1922,23 @@ void ExportContextApi(py::module &m) {
         .def("lang_id_to_str", &Context::lang_id_to_str, "id"_a)
         .def("lang_detect", &Context::lang_detect, "offset_ms"_a,
              "threads"_a = 1)
+        .def(
+            "lang_detect_batch",
+            [](Context &context, std::vector<std::vector<float>> clips,
+               int n_states, int threads, int audio_ctx) {
+                std::vector<float> probs;
+                {
+                    py::gil_scoped_release release;
+                    probs = context.lang_detect_batch(clips, n_states, threads,
+                                                      audio_ctx);
+                }
+                const ssize_t n_langs = context.lang_max_id() + 1;
+                py::array_t<float> out(
+                    std::vector<ssize_t>{(ssize_t)clips.size(), n_langs});
+                std::copy(probs.begin(), probs.end(), out.mutable_data());
+                return out;
+            },
+            "clips"_a, "n_states"_a = 4, "threads"_a = 1, "audio_ctx"_a = 0)
         .def("get_logits", &Context::get_logits, "segment"_a)
         .def("token_to_str", &Context::token_to_str, "token_id"_a)
         .def(
@@ -611,6 +1955,7 @@ void ExportContextApi(py::module &m) {
         .def_property_readonly("n_text_ctx", &Context::n_text_ctx)
         .def_property_readonly("n_audio_ctx", &Context::n_audio_ctx)
         .def_property_readonly("is_multilingual", &Context::is_multilingual)
+        .def_property_readonly("model_id", &Context::model_id)
         .def_property_readonly("eot_token", &Context::eot_token)
         .def_property_readonly("sot_token", &Context::sot_token)
         .def_property_readonly("prev_token", &Context::prev_token)
@@ -622,11 +1967,27 @@ void ExportContextApi(py::module &m) {
         .def("print_timings", &Context::print_timings)
         .def("reset_timings", &Context::reset_timings)
         .def("sys_info", &Context::sys_info)
-        .def("full", &Context::full, "params"_a, "data"_a,
-             py::call_guard<py::gil_scoped_release>())
+        .def("full",
+             static_cast<int (Context::*)(Params, std::vector<float>)>(
+                 &Context::full),
+             "params"_a, "data"_a, py::call_guard<py::gil_scoped_release>())
+        .def("full",
+             static_cast<int (Context::*)(const ParamsSnapshot &,
+                                          std::vector<float>)>(&Context::full),
+             "params"_a, "data"_a, py::call_guard<py::gil_scoped_release>())
         .def("full_parallel", &Context::full_parallel, "params"_a, "data"_a,
              "num_processor"_a, py::call_guard<py::gil_scoped_release>(),
              py::keep_alive<1, 2>())
+        .def("autotune", &whisper::autotune, "profile_path"_a = "",
+             "force"_a = false, "max_workers"_a = 4,
+             py::call_guard<py::gil_scoped_release>())
+        .def("full_multi", &Context::full_multi, "variants"_a, "data"_a,
+             py::call_guard<py::gil_scoped_release>())
+        .def("set_transcription_cache", &Context::set_transcription_cache,
+             "cache"_a)
+        .def_property_readonly("transcription_cache",
+                               &Context::get_transcription_cache)
+        .def("full_segments", &Context::full_segments)
         .def("full_n_segments", &Context::full_n_segments)
         .def("full_lang_id", &Context::full_lang_id)
         .def("full_get_segment_start", &Context::full_get_segment_t0,
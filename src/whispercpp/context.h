@@ -2,26 +2,34 @@
 
 #ifdef BAZEL_BUILD
 #include "pybind11/functional.h"
+#include "pybind11/numpy.h"
 #include "pybind11/pybind11.h"
 #include "pybind11/stl.h"
 #include "whisper.h"
 #else
 #include "pybind11/functional.h"
+#include "pybind11/numpy.h"
 #include "pybind11/pybind11.h"
 #include "pybind11/stl.h"
 #include "whisper.h"
 #endif
+
+#include "cache.h"
+#include "logits.h"
+
 #include <algorithm>
 #include <cassert>
 #include <cstddef>
 #include <functional>
 #include <iostream>
+#include <map>
 #include <memory>
 #include <numeric>
 #include <sstream>
 #include <stdexcept>
 #include <stdio.h>
 #include <string>
+#include <tuple>
 #include <type_traits>
 #include <utility>
 #include <vector>
@@ -55,10 +63,19 @@ struct SamplingGreedy : public SamplingType {
 
 struct SamplingBeamSearch : public SamplingType {
   public:
+    // NOTE: whisper.cpp evaluates each decoder with a graph of its own
+    // (the cross-attention K/V are shared, the weights are read once per
+    // decoder), so every step of beam_size beams (or best_of samples) costs
+    // about beam_size greedy steps. Batching them is not done yet: the
+    // compute hook could build one graph for all active decoders at the
+    // first decoder graph of a step and serve the logits of the others,
+    // as the prompt prefill reuse does.
     int beam_size; // ref:
                    // https://github.com/openai/whisper/blob/f82bc59f5ea234d4b97fb2860842ed38519f7e65/whisper/transcribe.py#L265
-    float patience; // NOTE: upstream not implemented, ref:
-                    // https://arxiv.org/pdf/2204.05424.pdf
+    // Stop once round(beam_size * patience) beams have finished. Values
+    // from 1 up decode every beam to the end, as whisper.cpp does, and
+    // values <= 0 leave it off. ref: https://arxiv.org/pdf/2204.05424.pdf
+    float patience;
     SamplingBeamSearch() : beam_size(-1), patience(-1.0f) {}
 
     SamplingBeamSearch(int beam_size, float patience)
@@ -145,11 +162,26 @@ struct Params {
   private:
     std::shared_ptr<whisper_full_params> fp;
     std::string language;
+    std::vector<whisper_token> prompt_tokens;
+    // shared by copies, replaced rather than changed
+    std::shared_ptr<const whisper::LogitsProcessor> logits_processor;
+    int numa_node = -1;
+    int encoder_threads = 0;
+    int decoder_threads = 0;
+    int speculative_fallback = 0;
 
     CallbackAndContext<NewSegmentCallback> new_segment_callback;
     CallbackAndContext<ProgressCallback> progress_callback;
 
     friend struct Context;
+    friend class ParamsSnapshot;
+
+    // A copy of the logits processor to change and install.
+    whisper::LogitsProcessor *edit_logits_processor();
+
+    // Point fp at this Params' own language, prompt tokens and callback
+    // data, where other's fp pointed at other's.
+    void rebind(const Params &other);
 
     // this copies Params for submitting it to whisper_full{,_parallel}
     // A single Params can be used for multiple whisper_full{,_parallel} calls,
@@ -169,6 +201,8 @@ struct Params {
         : fp(fp), new_segment_callback(new_segment_callback),
           progress_callback(progress_callback){};
 
+    // Copies are deep: a copy can be changed, or submitted to whisper_full,
+    // without affecting the original.
     Params(Params const &);
     Params &operator=(Params const &);
 
@@ -418,8 +452,102 @@ struct Params {
         return this;
     }
 
-    /// Set no_speech_thold. Currently (as of v1.2.0) not implemented.
-    /// Defaults to 0.6.
+    // Set the number of threads used by the encoder (including the
+    // cross-attention precompute). 0 uses n_threads.
+    // Defaults to 0.
+    Params *with_encoder_threads(int threads) {
+        encoder_threads = threads;
+        return this;
+    }
+    int get_encoder_threads() const { return encoder_threads; }
+
+    // Set the number of threads used by each decoder step. Decoder steps
+    // are small and stop scaling after a few threads. 0 uses n_threads.
+    // Defaults to 0.
+    Params *with_decoder_threads(int threads) {
+        decoder_threads = threads;
+        return this;
+    }
+    int get_decoder_threads() const { return decoder_threads; }
+
+    // Run on the cpus of the given NUMA node (Linux only). -1 uses the node
+    // the context's state was created on, if any.
+    // Defaults to -1.
+    Params *with_numa_node(int numa_node) {
+        this->numa_node = numa_node;
+        return this;
+    }
+    int get_numa_node() const { return numa_node; }
+
+    // Decode the fallback temperatures (temperature + k * temperature_inc)
+    // speculatively: up to n_states more states start decoding right away,
+    // each from one of the next temperatures, instead of waiting for the
+    // lower ones to fail. The lowest temperature that decodes without
+    // falling back wins and the states above it are cancelled. Only audio
+    // that fits in one 30s window is raced, since a window that falls back
+    // would otherwise send the whole transcript to a higher temperature.
+    // 0 to fall back one temperature after another.
+    // Defaults to 0.
+    Params *with_speculative_fallback(int n_states) {
+        speculative_fallback = n_states;
+        return this;
+    }
+    int get_speculative_fallback() const { return speculative_fallback; }
+
+    // Only sample text tokens from this list. Special tokens (end of text,
+    // timestamps, ...) stay allowed. Empty to allow all.
+    // Defaults to empty.
+    Params *with_allowed_tokens(const std::vector<whisper_token> &tokens) {
+        edit_logits_processor()->set_allowed(tokens);
+        return this;
+    }
+
+    // Never sample these tokens, special ones included.
+    // Defaults to empty.
+    Params *with_denied_tokens(const std::vector<whisper_token> &tokens) {
+        edit_logits_processor()->set_denied(tokens);
+        return this;
+    }
+
+    // Add bias[token] to the logit of each token before sampling. Negative
+    // values make a token less likely.
+    // Defaults to empty.
+    Params *with_token_bias(const std::map<whisper_token, float> &bias) {
+        edit_logits_processor()->set_bias(bias);
+        return this;
+    }
+
+    // Never sample text tokens longer than this many bytes. 0 for no limit.
+    // Defaults to 0.
+    Params *with_max_token_length(int max_length) {
+        edit_logits_processor()->set_max_token_length(max_length);
+        return this;
+    }
+
+    // Boost the logits of tokens that continue one of these phrases (or
+    // start one) by boost, to help with names and domain terms. Phrases are
+    // tokenized once per model.
+    // Defaults to empty.
+    Params *with_hotwords(const std::vector<std::string> &phrases,
+                          float boost) {
+        edit_logits_processor()->set_hotwords(phrases, boost);
+        return this;
+    }
+
+    // Only decode text matching this regular expression, e.g. "\\d{4}" or
+    // "yes|no", in every window. Decoding of a window stops as soon as its
+    // text is a complete match that can't be extended. Throws
+    // std::invalid_argument on a bad pattern. Empty for no constraint.
+    // Defaults to empty.
+    Params *with_regex_constraint(const std::string &pattern) {
+        edit_logits_processor()->set_constraint(pattern);
+        return this;
+    }
+
+    /// Set no_speech_thold. A window whose probability of the no-speech
+    /// token at the first decoder step is above it is judged silent, and
+    /// produces no segment without being decoded further.
+    /// Defaults to 1.0 (off).
     Params *with_no_speech_thold(float no_speech_thold) {
         fp->no_speech_thold = no_speech_thold;
         return this;
@@ -450,25 +578,105 @@ struct Params {
     void set_logits_filter_callback_user_data(void *user_data);
 };
 
+// A frozen copy of Params, for submitting the same settings many times and
+// from several threads at once. Unlike Params it can't be changed after it
+// is built, so it can be shared without locking, and Context::full runs
+// from it without copying it to the heap.
+class ParamsSnapshot {
+  public:
+    explicit ParamsSnapshot(const Params &params);
+    ParamsSnapshot(const ParamsSnapshot &other);
+    ParamsSnapshot &operator=(const ParamsSnapshot &other);
+
+    const whisper_full_params &get() const { return fp; }
+    int get_encoder_threads() const { return encoder_threads; }
+    int get_decoder_threads() const { return decoder_threads; }
+    int get_numa_node() const { return numa_node; }
+    int get_speculative_fallback() const { return speculative_fallback; }
+    // null without logits rules
+    const whisper::LogitsProcessor *get_logits_processor() const {
+        return logits_processor.get();
+    }
+
+    // Hash of the fields that change what is decoded, see hash_params.
+    uint64_t decoding_hash() const { return m_decoding_hash; }
+    // Hash of all settings, callbacks and printing aside.
+    uint64_t hash() const { return m_hash; }
+    bool operator==(const ParamsSnapshot &other) const;
+
+    // fp for one whisper_full call, with the callbacks handed context
+    // through new_segment and progress, which must outlive the call.
+    whisper_full_params
+    bind(Context &context,
+         CallbackAndContext<Params::NewSegmentCallback>::Container *new_segment,
+         CallbackAndContext<Params::ProgressCallback>::Container *progress)
+        const;
+
+  private:
+    void rebind();
+
+    whisper_full_params fp;
+    std::string language;
+    bool has_language;
+    std::vector<whisper_token> prompt_tokens;
+    std::shared_ptr<const whisper::LogitsProcessor> logits_processor;
+    int numa_node;
+    int encoder_threads;
+    int decoder_threads;
+    int speculative_fallback;
+
+    CallbackAndContext<Params::NewSegmentCallback>::Container new_segment;
+    CallbackAndContext<Params::ProgressCallback>::Container progress;
+
+    uint64_t m_decoding_hash;
+    uint64_t m_hash;
+};
+
 void ExportParamsApi(py::module &m);
 
 void ExportSamplingStrategiesApi(py::module &m);
 
 struct Context {
   private:
-    whisper_context *wctx;
+    whisper_context *wctx = nullptr;
     whisper_state *wstate = nullptr;
 
-    bool init_with_state;
-    bool spectrogram_initialized;
-    bool encode_completed;
-    bool decode_once;
+    bool init_with_state = false;
+    bool spectrogram_initialized = false;
+    bool encode_completed = false;
+    bool decode_once = false;
+
+    // NUMA node the state was created on, -1 if not bound.
+    int numa_node = -1;
+    // Whether the state keeps its K/V caches in f16.
+    bool kv_f16 = false;
+
+    // Shared with the states cloned from this context.
+    std::shared_ptr<whisper::TranscriptionCache> transcription_cache;
+    // Hash of the model in transcription cache keys, 0 until first needed.
+    uint64_t cached_model_hash = 0;
+
+    // State inference runs on: the context's own one when initialized
+    // with a state, wstate otherwise.
+    whisper_state *current_state();
+
+    // Decode data from n_runs temperatures at once, see
+    // Params::with_speculative_fallback, and leave the winning transcript
+    // in the current state.
+    void full_race(const ParamsSnapshot &params, const std::vector<float> &data,
+                   int n_runs);
 
   public:
+    // (t0, t1, text) of a segment, timestamps in 10ms units
+    typedef std::tuple<int64_t, int64_t, std::string> Segment;
+
     ~Context() = default;
 
     // setters functions
-    void set_context(whisper_context *wctx) { this->wctx = wctx; }
+    void set_context(whisper_context *wctx) {
+        this->wctx = wctx;
+        this->cached_model_hash = 0;
+    }
     void set_state(whisper_state *wstate) { this->wstate = wstate; }
 
     // check if whether context is set with state
@@ -479,7 +687,21 @@ struct Context {
 
     void free();
     void free_state();
-    void init_state();
+    // Release the memory the state only needs while decoding: the K/V
+    // caches of the extra decoders best_of and beam search allocate, which
+    // are kept for the next call otherwise, and the last spectrogram. The
+    // next call needing them allocates them again. Results are kept.
+    // Returns the number of bytes released.
+    size_t trim_state();
+    // Create a new state. With numa_node >= 0 its buffers are allocated on
+    // that node, and computes on it run on the node's cpus by default.
+    // With kv_f16 the self and cross-attention K/V caches hold f16 values
+    // for models with f32 weights too, which halves them (f16 models use
+    // f16 caches either way). States cloned from this one inherit it.
+    void init_state(int numa_node = -1, bool kv_f16 = false);
+    // A copy sharing this context's model, running on a new state of its
+    // own. The copy's state has to be freed with free_state(), not free().
+    Context clone_with_state(int numa_node = -1);
 
     static Context from_file(const char *filename, bool no_state = false);
     static Context from_buffer(void *buffer, size_t buffer_size,
@@ -503,6 +725,14 @@ struct Context {
     // first frame in the spectrogram. Returns 0 on success
     void encode(size_t offset, size_t threads);
 
+    // Encoder-side counterpart of set_mel: the cross-attention K and V the
+    // decoder reads, as (n_text_layer, n_ctx, n_text_state) arrays. The
+    // getter returns zero-copy views kept alive by owner, valid until the
+    // state is encoded again or freed. The setter lets decode() run on a
+    // previously exported encoding without calling encode().
+    std::pair<py::array, py::array> get_encoder_output(py::handle owner);
+    void set_encoder_output(py::array k, py::array v);
+
     // Run the Whisper decoder to obtain the logits and probabilities for the
     // next token. Make sure to call whisper_encode() first. tokens + n_tokens
     // is the provided context for the decoder. n_past is the number of tokens
@@ -526,11 +756,22 @@ struct Context {
     // language functions. Returns a vector of probabilities for each language.
     std::vector<float> lang_detect(size_t offset_ms, size_t threads);
 
+    // Language probabilities of many clips, row-major n_clips x
+    // (lang_max_id() + 1). Clips are spread over n_states states of this
+    // context, each computing mels and detecting with 'threads' threads.
+    // Only the frames a clip covers are encoded: audio_ctx = 0 derives the
+    // encoder context from each clip's length, > 0 fixes it.
+    std::vector<float>
+    lang_detect_batch(std::vector<std::vector<float>> &clips,
+                      int n_states, int threads, int audio_ctx);
+
     size_t n_len();
     size_t n_vocab();
     size_t n_text_ctx();
     size_t n_audio_ctx();
     bool is_multilingual();
+    // Identifies the loaded model by its hyperparameters and weight type.
+    std::string model_id();
 
     // Token logits obtained from the last call to whisper_decode()
     // The logits for the last token are stored in the last row
@@ -566,6 +807,23 @@ struct Context {
     // text Not thread safe for same context Uses the specified decoding
     // strategy to obtain the text.
     int full(Params params, std::vector<float> data);
+    // Same as full(Params), but safe to call with one snapshot from several
+    // threads (on different states).
+    int full(const ParamsSnapshot &params, std::vector<float> data);
+
+    // Answer full() calls from, and store their results in, cache. Calls
+    // whose result depends on more than the audio, params and model are
+    // not cached: with a logits filter or encoder begin callback, or with
+    // text carried over from a previous call. On a hit no inference runs
+    // and the new segment callback gets all the segments at once. Pass None
+    // to stop caching.
+    void set_transcription_cache(
+        std::shared_ptr<whisper::TranscriptionCache> cache) {
+        transcription_cache = std::move(cache);
+    }
+    std::shared_ptr<whisper::TranscriptionCache> get_transcription_cache() {
+        return transcription_cache;
+    }
 
     // Split the input audio in chunks and process each chunk separately using
     // whisper_full_with_state() Result is stored in the default state of the
@@ -576,6 +834,18 @@ struct Context {
     int full_parallel(Params params, std::vector<float> data,
                       int num_processor);
 
+    // Run the entire model once per variant (e.g. transcribe and translate,
+    // or different languages or prompts) over the same audio, and return
+    // the segments of each. Variants decode concurrently on states of their
+    // own, sharing every window's encoder output: a window is encoded once
+    // by whichever variant gets to it first. The first variant runs on the
+    // context's state, so the full_* getters return its result afterwards.
+    std::vector<std::vector<Segment>> full_multi(std::vector<Params> variants,
+                                                 std::vector<float> data);
+
+    // Segments of the last full() run, as (t0, t1, text).
+    std::vector<Segment> full_segments();
+
     // Number of generated text segments
     // A segment can be a few words, a sentence, or even a paragraph.
     int full_n_segments();
@@ -0,0 +1,15 @@
+// ggml compiled with its per-compute worker threads redirected to the
+// binding's persistent pool. See threadpool.h.
+#include "threadpool.h"
+
+#ifndef _WIN32
+#define pthread_create whisper_cpp2py_thread_create
+#define pthread_join whisper_cpp2py_thread_join
+#endif
+
+#include "ggml.c"
+
+#ifndef _WIN32
+#undef pthread_create
+#undef pthread_join
+#endif
@@ -0,0 +1,366 @@
+#include "logits.h"
+#include "cache.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+namespace whisper {
+
+LogitsProcessor::LogitsProcessor(const LogitsProcessor &other)
+    : m_allowed(other.m_allowed), m_has_allowed(other.m_has_allowed),
+      m_denied(other.m_denied), m_bias(other.m_bias),
+      m_max_token_length(other.m_max_token_length),
+      m_hotwords(other.m_hotwords), m_hotword_boost(other.m_hotword_boost),
+      m_constraint(other.m_constraint) {}
+
+void LogitsProcessor::Trie::insert(const std::vector<whisper_token> &tokens) {
+    int node = 0;
+    for (whisper_token token : tokens) {
+        std::vector<std::pair<whisper_token, int>> &children =
+            nodes[node].children;
+        std::vector<std::pair<whisper_token, int>>::iterator it =
+            std::lower_bound(children.begin(), children.end(),
+                             std::make_pair(token, 0));
+        if (it != children.end() && it->first == token) {
+            node = it->second;
+            continue;
+        }
+        const int child = (int)nodes.size();
+        children.insert(it, std::make_pair(token, child));
+        // NOTE: may reallocate nodes, children is not used after this
+        nodes.push_back(Node());
+        node = child;
+    }
+    max_depth = std::max(max_depth, (int)tokens.size());
+}
+
+int LogitsProcessor::Trie::next(int node, whisper_token token) const {
+    const std::vector<std::pair<whisper_token, int>> &children =
+        nodes[node].children;
+    std::vector<std::pair<whisper_token, int>>::const_iterator it =
+        std::lower_bound(children.begin(), children.end(),
+                         std::make_pair(token, 0));
+    return it != children.end() && it->first == token ? it->second : -1;
+}
+
+void LogitsProcessor::Compiled::constrain(whisper_context *ctx,
+                                          const whisper_token_data *tokens,
+                                          int n_tokens, float *logits) const {
+    const float masked = -std::numeric_limits<float>::infinity();
+    int state = constraint->start();
+    for (int i = 0; i < n_tokens && state != ByteDfa::kDead; ++i) {
+        if (tokens[i].id < eot) {
+            state = constraint->step(state, whisper_token_to_str(ctx, tokens[i].id));
+        }
+    }
+    if (state == ByteDfa::kDead) {
+        // only possible if something else picked the token, leave it be
+        return;
+    }
+
+    const uint64_t *allowed = &constraint_allowed[(size_t)state * n_words];
+    for (int w = 0; w * 64 < eot; ++w) {
+        const uint64_t bits = allowed[w];
+        if (bits == ~uint64_t(0)) {
+            continue;
+        }
+        const int end = std::min(eot, (w + 1) * 64);
+        for (int i = w * 64; i < end; ++i) {
+            if (!((bits >> (i - w * 64)) & 1)) {
+                logits[i] = masked;
+            }
+        }
+    }
+    if (!constraint->accepting(state)) {
+        logits[eot] = masked;
+    } else if (!constraint_open[state]) {
+        // the match is complete and can't grow, end the window now
+        const float keep = logits[eot];
+        for (int i = 0; i < (int)add.size(); ++i) {
+            logits[i] = masked;
+        }
+        logits[eot] = keep;
+    }
+}
+
+void LogitsProcessor::Compiled::boost(const whisper_token_data *tokens,
+                                      int n_tokens, float *logits) const {
+    // Every suffix of the decoded text no longer than the longest phrase is
+    // walked from the root; where the walk ends inside the trie, a phrase
+    // is under way and its possible next tokens are boosted. The empty
+    // suffix boosts the first token of every phrase. That is at most
+    // max_depth^2 / 2 lookups, next to nothing beside a decoder step.
+    const int first = std::max(0, n_tokens - hotwords.max_depth);
+    for (int start = first; start <= n_tokens; ++start) {
+        int node = 0;
+        for (int i = start; i < n_tokens && node >= 0; ++i) {
+            // timestamps and other special tokens break a phrase
+            node = tokens[i].id < eot ? hotwords.next(node, tokens[i].id) : -1;
+        }
+        if (node < 0) {
+            continue;
+        }
+        for (const std::pair<whisper_token, int> &child :
+             hotwords.nodes[node].children) {
+            logits[child.first] += hotword_boost;
+        }
+    }
+}
+
+void LogitsProcessor::set_bits(std::vector<uint64_t> *mask,
+                               const std::vector<whisper_token> &tokens) {
+    mask->clear();
+    for (whisper_token token : tokens) {
+        if (token < 0) {
+            continue;
+        }
+        const size_t word = (size_t)token / 64;
+        if (word >= mask->size()) {
+            mask->resize(word + 1, 0);
+        }
+        (*mask)[word] |= uint64_t(1) << (token % 64);
+    }
+}
+
+bool LogitsProcessor::test_bit(const std::vector<uint64_t> &mask,
+                               int token) {
+    const size_t word = (size_t)token / 64;
+    return word < mask.size() && (mask[word] >> (token % 64)) & 1;
+}
+
+void LogitsProcessor::set_allowed(const std::vector<whisper_token> &tokens) {
+    set_bits(&m_allowed, tokens);
+    m_has_allowed = !tokens.empty();
+}
+
+void LogitsProcessor::set_denied(const std::vector<whisper_token> &tokens) {
+    set_bits(&m_denied, tokens);
+}
+
+void LogitsProcessor::set_bias(const std::map<whisper_token, float> &bias) {
+    m_bias = bias;
+}
+
+void LogitsProcessor::set_max_token_length(int max_length) {
+    m_max_token_length = std::max(0, max_length);
+}
+
+void LogitsProcessor::set_hotwords(const std::vector<std::string> &phrases,
+                                   float boost) {
+    m_hotwords = phrases;
+    m_hotword_boost = boost;
+}
+
+void LogitsProcessor::set_constraint(const std::string &pattern) {
+    if (pattern.empty()) {
+        m_constraint.reset();
+        return;
+    }
+    // whisper puts a space in front of the first word
+    m_constraint = std::make_shared<ByteDfa>(" *(" + pattern + ")");
+}
+
+bool LogitsProcessor::empty() const {
+    return !m_has_allowed && m_denied.empty() && m_bias.empty() &&
+           m_max_token_length == 0 &&
+           (m_hotwords.empty() || m_hotword_boost == 0.0f) && !m_constraint;
+}
+
+uint64_t LogitsProcessor::hash(uint64_t seed) const {
+    uint64_t h = hash_bytes(m_allowed.data(),
+                            m_allowed.size() * sizeof(uint64_t), seed);
+    h = hash_bytes(m_denied.data(), m_denied.size() * sizeof(uint64_t), h);
+    for (const std::pair<const whisper_token, float> &bias : m_bias) {
+        h = hash_bytes(&bias.first, sizeof(bias.first), h);
+        h = hash_bytes(&bias.second, sizeof(bias.second), h);
+    }
+    h = hash_bytes(&m_max_token_length, sizeof(m_max_token_length), h);
+    for (const std::string &phrase : m_hotwords) {
+        // length first, so ["ab", "c"] and ["a", "bc"] differ
+        const size_t size = phrase.size();
+        h = hash_bytes(&size, sizeof(size), h);
+        h = hash_bytes(phrase.data(), phrase.size(), h);
+    }
+    h = hash_bytes(&m_hotword_boost, sizeof(m_hotword_boost), h);
+    if (m_constraint) {
+        h = hash_bytes(m_constraint->pattern().data(),
+                       m_constraint->pattern().size(), h);
+    }
+    return h;
+}
+
+const LogitsProcessor::Compiled *
+LogitsProcessor::compile(whisper_context *ctx) const {
+    const int n_vocab = whisper_n_vocab(ctx);
+    std::lock_guard<std::mutex> lock(m_mutex);
+    Compiled &compiled = m_compiled[std::make_pair(ctx, n_vocab)];
+    std::vector<float> &add = compiled.add;
+    if ((int)add.size() == n_vocab) {
+        return &compiled;
+    }
+
+    const float masked = -std::numeric_limits<float>::infinity();
+    const whisper_token eot = whisper_token_eot(ctx);
+    add.assign(n_vocab, 0.0f);
+    for (int i = 0; i < n_vocab; ++i) {
+        if (test_bit(m_denied, i)) {
+            add[i] = masked;
+        } else if (i < eot) {
+            if (m_has_allowed && !test_bit(m_allowed, i)) {
+                add[i] = masked;
+            } else if (m_max_token_length > 0 &&
+                       strlen(whisper_token_to_str(ctx, i)) >
+                           (size_t)m_max_token_length) {
+                add[i] = masked;
+            }
+        }
+    }
+    for (const std::pair<const whisper_token, float> &bias : m_bias) {
+        if (bias.first >= 0 && bias.first < n_vocab) {
+            add[bias.first] += bias.second;
+        }
+    }
+
+    compiled.eot = eot;
+    compiled.hotword_boost = m_hotword_boost;
+    compiled.hotwords = Trie();
+    if (m_hotword_boost != 0.0f) {
+        std::vector<whisper_token> tokens;
+        for (const std::string &phrase : m_hotwords) {
+            // mid-sentence words come with a leading space
+            const std::string variants[] = {phrase, " " + phrase};
+            for (const std::string &text : variants) {
+                // a phrase can't have more tokens than bytes
+                tokens.resize(text.size() + 1);
+                const int n = whisper_tokenize(ctx, text.c_str(),
+                                               tokens.data(), tokens.size());
+                if (n > 0) {
+                    tokens.resize(n);
+                    compiled.hotwords.insert(tokens);
+                }
+            }
+        }
+    }
+
+    compiled.constraint = m_constraint;
+    if (m_constraint) {
+        compile_constraint(ctx, &compiled);
+    }
+    return &compiled;
+}
+
+void LogitsProcessor::compile_constraint(whisper_context *ctx,
+                                         Compiled *compiled) {
+    const ByteDfa &dfa = *compiled->constraint;
+    const int eot = compiled->eot;
+    const int n_vocab = (int)compiled->add.size();
+    compiled->n_words = (n_vocab + 63) / 64;
+    compiled->constraint_allowed.assign(
+        (size_t)dfa.n_states() * compiled->n_words, 0);
+    compiled->constraint_open.assign(dfa.n_states(), false);
+
+    // Text tokens sorted by their bytes, with how many bytes each shares
+    // with the one before. Walking them in order, the automaton only has to
+    // step over the bytes past the shared prefix, and all tokens under a
+    // prefix that is already dead are skipped at once.
+    std::vector<std::pair<std::string, whisper_token>> sorted;
+    sorted.reserve(eot);
+    for (whisper_token i = 0; i < eot; ++i) {
+        sorted.push_back(std::make_pair(whisper_token_to_str(ctx, i), i));
+    }
+    std::sort(sorted.begin(), sorted.end());
+    std::vector<size_t> shared(sorted.size(), 0);
+    for (size_t k = 1; k < sorted.size(); ++k) {
+        const std::string &a = sorted[k - 1].first;
+        const std::string &b = sorted[k].first;
+        size_t n = 0;
+        while (n < a.size() && n < b.size() && a[n] == b[n]) {
+            ++n;
+        }
+        shared[k] = n;
+    }
+
+    // path[j] is the state after the first j bytes of the current token
+    std::vector<int> path;
+    for (int s = 0; s < dfa.n_states(); ++s) {
+        uint64_t *allowed =
+            &compiled->constraint_allowed[(size_t)s * compiled->n_words];
+        path.assign(1, s);
+        for (size_t k = 0; k < sorted.size(); ++k) {
+            const std::string &text = sorted[k].first;
+            const size_t from = std::min(shared[k], path.size() - 1);
+            path.resize(from + 1);
+            int state = path[from];
+            for (size_t j = from; j < text.size() && state != ByteDfa::kDead;
+                 ++j) {
+                state = dfa.step(state, (unsigned char)text[j]);
+                path.push_back(state);
+            }
+            if (state != ByteDfa::kDead && !text.empty() &&
+                path.size() == text.size() + 1) {
+                const whisper_token token = sorted[k].second;
+                allowed[token / 64] |= uint64_t(1) << (token % 64);
+                compiled->constraint_open[s] = true;
+            }
+        }
+    }
+}
+
+void LogitsProcessor::apply(const float *add, float *logits, int n) {
+    int i = 0;
+#if defined(__AVX__)
+    for (; i + 8 <= n; i += 8) {
+        _mm256_storeu_ps(logits + i, _mm256_add_ps(_mm256_loadu_ps(logits + i),
+                                                   _mm256_loadu_ps(add + i)));
+    }
+#elif defined(__ARM_NEON)
+    for (; i + 4 <= n; i += 4) {
+        vst1q_f32(logits + i, vaddq_f32(vld1q_f32(logits + i),
+                                        vld1q_f32(add + i)));
+    }
+#endif
+    for (; i < n; ++i) {
+        logits[i] += add[i];
+    }
+}
+
+void LogitsFilterChain::install(const LogitsProcessor &processor,
+                                whisper_context *ctx,
+                                whisper_full_params *params) {
+    compiled = processor.compile(ctx);
+    next = params->logits_filter_callback;
+    next_user_data = params->logits_filter_callback_user_data;
+    params->logits_filter_callback = callback;
+    params->logits_filter_callback_user_data = this;
+}
+
+void LogitsFilterChain::callback(whisper_context *ctx, whisper_state *state,
+                                 const whisper_token_data *tokens,
+                                 int n_tokens, float *logits,
+                                 void *user_data) {
+    const LogitsFilterChain *chain =
+        static_cast<const LogitsFilterChain *>(user_data);
+    const LogitsProcessor::Compiled *compiled = chain->compiled;
+    LogitsProcessor::apply(compiled->add.data(), logits,
+                           (int)compiled->add.size());
+    if (compiled->constraint) {
+        compiled->constrain(ctx, tokens, n_tokens, logits);
+    }
+    if (!compiled->hotwords.empty()) {
+        compiled->boost(tokens, n_tokens, logits);
+    }
+    if (chain->next != nullptr) {
+        chain->next(ctx, state, tokens, n_tokens, logits,
+                    chain->next_user_data);
+    }
+}
+
+} // namespace whisper
@@ -0,0 +1,144 @@
+#pragma once
+
+#ifdef BAZEL_BUILD
+#include "whisper.h"
+#else
+#include "whisper.h"
+#endif
+
+#include "automaton.h"
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace whisper {
+
+// Logits rules configured from Params and applied natively in every
+// decoder step, without a callback into Python:
+//  - an allow list: text tokens outside it are never sampled,
+//  - a deny list: these tokens (text or special) are never sampled,
+//  - additive per-token biases,
+//  - a cap on the length in bytes of a text token,
+//  - hotwords: phrases whose next token is boosted once the text decoded so
+//    far ends in a prefix of them (or at any point, for the first token).
+//  - a regular expression the text of a window has to match: tokens that
+//    can't continue a match are masked, end of text is only allowed on a
+//    full match and forced once the match can't grow any further.
+// Special tokens (end of text, timestamps, ...) are left to whisper.cpp's
+// own rules unless denied explicitly, so decoding can always finish.
+//
+// For a given model all static rules fold into one vector added to the
+// logits, and the hotwords into a token trie, both built on first use and
+// kept for later calls.
+class LogitsProcessor {
+  public:
+    // Token trie of the hotword phrases, children sorted by token.
+    struct Trie {
+        struct Node {
+            std::vector<std::pair<whisper_token, int>> children;
+        };
+        std::vector<Node> nodes;
+        int max_depth = 0;
+
+        Trie() : nodes(1) {}
+        void insert(const std::vector<whisper_token> &tokens);
+        // child of node reached through token, -1 if none
+        int next(int node, whisper_token token) const;
+        bool empty() const { return nodes[0].children.empty(); }
+    };
+
+    // What a processor turns into for one model.
+    struct Compiled {
+        // n_vocab values to add to the logits
+        std::vector<float> add;
+        Trie hotwords;
+        float hotword_boost = 0.0f;
+        whisper_token eot = 0;
+        // text tokens allowed in each automaton state, n_words per state
+        std::shared_ptr<const ByteDfa> constraint;
+        std::vector<uint64_t> constraint_allowed;
+        // whether any text token is allowed in each state
+        std::vector<bool> constraint_open;
+        int n_words = 0;
+
+        // Mask the tokens that can't continue a match of the constraint
+        // after tokens.
+        void constrain(whisper_context *ctx, const whisper_token_data *tokens,
+                       int n_tokens, float *logits) const;
+
+        // Boost the tokens that extend a hotword path active at the end of
+        // tokens.
+        void boost(const whisper_token_data *tokens, int n_tokens,
+                   float *logits) const;
+    };
+
+    LogitsProcessor() = default;
+    // the built vectors are not copied
+    LogitsProcessor(const LogitsProcessor &other);
+    LogitsProcessor &operator=(const LogitsProcessor &) = delete;
+
+    // Replace the allow list. An empty list allows every token.
+    void set_allowed(const std::vector<whisper_token> &tokens);
+    // Replace the deny list.
+    void set_denied(const std::vector<whisper_token> &tokens);
+    // Replace the biases.
+    void set_bias(const std::map<whisper_token, float> &bias);
+    // 0 means no cap.
+    void set_max_token_length(int max_length);
+    // Replace the hotwords. Each phrase is matched with and without a
+    // leading space.
+    void set_hotwords(const std::vector<std::string> &phrases, float boost);
+    // Replace the constraint, see ByteDfa for the syntax. Leading spaces
+    // are allowed before the match. Empty for none.
+    void set_constraint(const std::string &pattern);
+
+    bool empty() const;
+    uint64_t hash(uint64_t seed = 0) const;
+
+    const Compiled *compile(whisper_context *ctx) const;
+
+    // logits[i] += add[i] for i < n
+    static void apply(const float *add, float *logits, int n);
+
+  private:
+    static void set_bits(std::vector<uint64_t> *mask,
+                         const std::vector<whisper_token> &tokens);
+    static bool test_bit(const std::vector<uint64_t> &mask, int token);
+    static void compile_constraint(whisper_context *ctx, Compiled *compiled);
+
+    std::vector<uint64_t> m_allowed;
+    bool m_has_allowed = false;
+    std::vector<uint64_t> m_denied;
+    std::map<whisper_token, float> m_bias;
+    int m_max_token_length = 0;
+    std::vector<std::string> m_hotwords;
+    float m_hotword_boost = 0.0f;
+    std::shared_ptr<const ByteDfa> m_constraint;
+
+    mutable std::mutex m_mutex;
+    mutable std::map<std::pair<const whisper_context *, int>, Compiled>
+        m_compiled;
+};
+
+// Installs a LogitsProcessor as the logits_filter_callback of a
+// whisper_full_params, running after it any callback already set there.
+// Has to outlive the whisper_full call.
+struct LogitsFilterChain {
+    const LogitsProcessor::Compiled *compiled = nullptr;
+    whisper_logits_filter_callback next = nullptr;
+    void *next_user_data = nullptr;
+
+    void install(const LogitsProcessor &processor, whisper_context *ctx,
+                 whisper_full_params *params);
+
+    static void callback(whisper_context *ctx, whisper_state *state,
+                         const whisper_token_data *tokens, int n_tokens,
+                         float *logits, void *user_data);
+};
+
+} // namespace whisper
@@ -73,6 +73,9 @@ Params Params::from_sampling_strategy(SamplingStrategies *ss) {
     CallbackAndContext<ProgressCallback> progress_callback;
     fp.progress_callback = progress_callback_handler;
     fp.progress_callback_user_data = progress_callback.data.get();
+    // NOTE: whisper.cpp defaults to 0.6 without using it, keep silence
+    // detection off unless asked for so transcripts don't change.
+    fp.no_speech_thold = 1.0f;
 
     switch (strategy->to_enum()) {
     case WHISPER_SAMPLING_GREEDY:
@@ -97,23 +100,54 @@ Params::Params() {
 }
 
 Params::Params(Params const &other)
-    : fp(other.fp), new_segment_callback(other.new_segment_callback),
+    : fp(std::make_shared<whisper_full_params>(*other.fp)),
+      language(other.language), prompt_tokens(other.prompt_tokens),
+      logits_processor(other.logits_processor), numa_node(other.numa_node),
+      encoder_threads(other.encoder_threads),
+      decoder_threads(other.decoder_threads),
+      speculative_fallback(other.speculative_fallback),
+      new_segment_callback(other.new_segment_callback),
       progress_callback(other.progress_callback) {
-    fp->new_segment_callback = new_segment_callback_handler;
-    fp->new_segment_callback_user_data = new_segment_callback.data.get();
-    fp->progress_callback = progress_callback_handler;
-    fp->progress_callback_user_data = progress_callback.data.get();
+    rebind(other);
 }
 
 Params &Params::operator=(Params const &other) {
-    fp = other.fp;
+    fp = std::make_shared<whisper_full_params>(*other.fp);
+    language = other.language;
+    prompt_tokens = other.prompt_tokens;
+    logits_processor = other.logits_processor;
+    numa_node = other.numa_node;
+    encoder_threads = other.encoder_threads;
+    decoder_threads = other.decoder_threads;
+    speculative_fallback = other.speculative_fallback;
     new_segment_callback = other.new_segment_callback;
+    progress_callback = other.progress_callback;
+    rebind(other);
+    return *this;
+}
+
+whisper::LogitsProcessor *Params::edit_logits_processor() {
+    // NOTE: copies and snapshots may share the current one, so change a
+    // copy of it
+    std::shared_ptr<whisper::LogitsProcessor> processor =
+        logits_processor
+            ? std::make_shared<whisper::LogitsProcessor>(*logits_processor)
+            : std::make_shared<whisper::LogitsProcessor>();
+    logits_processor = processor;
+    return processor.get();
+}
+
+void Params::rebind(const Params &other) {
+    if (other.fp->language == other.language.c_str()) {
+        fp->language = language.c_str();
+    }
+    if (other.fp->prompt_tokens == other.prompt_tokens.data()) {
+        fp->prompt_tokens = prompt_tokens.data();
+    }
     fp->new_segment_callback = new_segment_callback_handler;
     fp->new_segment_callback_user_data = new_segment_callback.data.get();
-    progress_callback = other.progress_callback;
     fp->progress_callback = progress_callback_handler;
     fp->progress_callback_user_data = progress_callback.data.get();
-    return *this;
 }
 
 Params Params::copy_for_full(Context &context) {
@@ -133,8 +167,112 @@ Params Params::copy_for_full(Context &context) {
 // overwrite the previous tokens. Defaults to an empty
 // vector.
 void Params::set_tokens(std::vector<int> &tokens) {
-    fp->prompt_tokens = reinterpret_cast<whisper_token *>(&tokens);
-    fp->prompt_n_tokens = tokens.size();
+    prompt_tokens.assign(tokens.begin(), tokens.end());
+    fp->prompt_tokens = prompt_tokens.data();
+    fp->prompt_n_tokens = prompt_tokens.size();
+}
+
+ParamsSnapshot::ParamsSnapshot(const Params &params)
+    : fp(*params.get()), has_language(fp.language != nullptr),
+      logits_processor(params.logits_processor), numa_node(params.numa_node),
+      encoder_threads(params.encoder_threads),
+      decoder_threads(params.decoder_threads),
+      speculative_fallback(params.speculative_fallback),
+      new_segment(*params.new_segment_callback.data),
+      progress(*params.progress_callback.data) {
+    // own everything fp points at, so the snapshot doesn't depend on
+    // params staying alive or unchanged
+    if (has_language) {
+        language = fp.language;
+    }
+    if (fp.prompt_tokens != nullptr && fp.prompt_n_tokens > 0) {
+        prompt_tokens.assign(fp.prompt_tokens,
+                             fp.prompt_tokens + fp.prompt_n_tokens);
+    }
+    new_segment.context = nullptr;
+    progress.context = nullptr;
+    rebind();
+
+    if (logits_processor && logits_processor->empty()) {
+        logits_processor.reset();
+    }
+    m_decoding_hash = whisper::hash_params(fp);
+    if (logits_processor) {
+        m_decoding_hash = logits_processor->hash(m_decoding_hash);
+    }
+    const int extra[] = {fp.n_threads, encoder_threads, decoder_threads,
+                         numa_node, speculative_fallback};
+    m_hash = whisper::hash_bytes(extra, sizeof(extra), m_decoding_hash);
+}
+
+ParamsSnapshot::ParamsSnapshot(const ParamsSnapshot &other)
+    : fp(other.fp), language(other.language),
+      has_language(other.has_language), prompt_tokens(other.prompt_tokens),
+      logits_processor(other.logits_processor), numa_node(other.numa_node),
+      encoder_threads(other.encoder_threads),
+      decoder_threads(other.decoder_threads),
+      speculative_fallback(other.speculative_fallback),
+      new_segment(other.new_segment), progress(other.progress),
+      m_decoding_hash(other.m_decoding_hash), m_hash(other.m_hash) {
+    rebind();
+}
+
+ParamsSnapshot &ParamsSnapshot::operator=(const ParamsSnapshot &other) {
+    fp = other.fp;
+    language = other.language;
+    has_language = other.has_language;
+    prompt_tokens = other.prompt_tokens;
+    logits_processor = other.logits_processor;
+    numa_node = other.numa_node;
+    encoder_threads = other.encoder_threads;
+    decoder_threads = other.decoder_threads;
+    speculative_fallback = other.speculative_fallback;
+    new_segment = other.new_segment;
+    progress = other.progress;
+    m_decoding_hash = other.m_decoding_hash;
+    m_hash = other.m_hash;
+    rebind();
+    return *this;
+}
+
+bool ParamsSnapshot::operator==(const ParamsSnapshot &other) const {
+    // NOTE: the remaining fp fields are only compared through the hashes
+    return m_hash == other.m_hash && m_decoding_hash == other.m_decoding_hash &&
+           prompt_tokens == other.prompt_tokens &&
+           has_language == other.has_language && language == other.language &&
+           fp.n_threads == other.fp.n_threads &&
+           encoder_threads == other.encoder_threads &&
+           decoder_threads == other.decoder_threads &&
+           numa_node == other.numa_node &&
+           speculative_fallback == other.speculative_fallback;
+}
+
+void ParamsSnapshot::rebind() {
+    fp.language = has_language ? language.c_str() : nullptr;
+    fp.prompt_tokens = prompt_tokens.empty() ? nullptr : prompt_tokens.data();
+    fp.prompt_n_tokens = prompt_tokens.size();
+    // set per call by bind()
+    fp.new_segment_callback = nullptr;
+    fp.new_segment_callback_user_data = nullptr;
+    fp.progress_callback = nullptr;
+    fp.progress_callback_user_data = nullptr;
+}
+
+whisper_full_params ParamsSnapshot::bind(
+    Context &context,
+    CallbackAndContext<Params::NewSegmentCallback>::Container *new_segment,
+    CallbackAndContext<Params::ProgressCallback>::Container *progress) const {
+    *new_segment = this->new_segment;
+    new_segment->context = &context;
+    *progress = this->progress;
+    progress->context = &context;
+
+    whisper_full_params out = fp;
+    out.new_segment_callback = new_segment_callback_handler;
+    out.new_segment_callback_user_data = new_segment;
+    out.progress_callback = progress_callback_handler;
+    out.progress_callback_user_data = progress;
+    return out;
 }
 
 // called for every newly generated text segments
@@ -208,6 +346,8 @@ std::string Params::to_string() const {
     }
     os << "language='" << fp->language << "', ";
     VALUE_REPR("num_threads", n_threads);
+    os << "encoder_threads=" << encoder_threads << ", ";
+    os << "decoder_threads=" << decoder_threads << ", ";
     VALUE_REPR("num_max_text_ctx", n_max_text_ctx);
     VALUE_REPR_SAME(offset_ms);
     VALUE_REPR_SAME(duration_ms);
@@ -236,7 +376,9 @@ std::string Params::to_string() const {
     VALUE_REPR_SAME(temperature_inc);
     VALUE_REPR("entropy_threshold", entropy_thold);
     VALUE_REPR("logprob_threshold", logprob_thold);
-    os << "no_speech_threshold=" << fp->no_speech_thold << ")";
+    os << "no_speech_threshold=" << fp->no_speech_thold << ", ";
+    os << "speculative_fallback=" << speculative_fallback << ", ";
+    os << "numa_node=" << numa_node << ")";
     return os.str();
 }
 
@@ -695,6 +837,37 @@ void ExportParamsApi(py::module &m) {
                 WITH_DEPRECATION("no_speech_threshold");
                 self.with_no_speech_thold(no_speech_thold);
             })
+        // NOTE setting the native logits rules
+        .def("with_allowed_tokens", &Params::with_allowed_tokens, "tokens"_a,
+             py::return_value_policy::reference)
+        .def("with_denied_tokens", &Params::with_denied_tokens, "tokens"_a,
+             py::return_value_policy::reference)
+        .def("with_token_bias", &Params::with_token_bias, "bias"_a,
+             py::return_value_policy::reference)
+        .def("with_max_token_length", &Params::with_max_token_length,
+             "max_length"_a, py::return_value_policy::reference)
+        .def("with_hotwords", &Params::with_hotwords, "phrases"_a,
+             "boost"_a = 2.0f, py::return_value_policy::reference)
+        .def("with_regex_constraint", &Params::with_regex_constraint,
+             "pattern"_a, py::return_value_policy::reference)
+        // NOTE setting encoder_threads and decoder_threads
+        .def("with_encoder_threads", &Params::with_encoder_threads,
+             "threads"_a, py::return_value_policy::reference)
+        .def_property_readonly("encoder_threads",
+                               &Params::get_encoder_threads)
+        .def("with_decoder_threads", &Params::with_decoder_threads,
+             "threads"_a, py::return_value_policy::reference)
+        .def_property_readonly("decoder_threads",
+                               &Params::get_decoder_threads)
+        // NOTE setting numa_node
+        .def("with_numa_node", &Params::with_numa_node, "numa_node"_a,
+             py::return_value_policy::reference)
+        .def_property_readonly("numa_node", &Params::get_numa_node)
+        // NOTE setting speculative_fallback
+        .def("with_speculative_fallback", &Params::with_speculative_fallback,
+             "n_states"_a, py::return_value_policy::reference)
+        .def_property_readonly("speculative_fallback",
+                               &Params::get_speculative_fallback)
         .def(
             "on_new_segment",
             [](Params &self, NewSegmentCallback &callback,
@@ -724,4 +897,19 @@ void ExportParamsApi(py::module &m) {
             "callback"_a, "user_data"_a = py::none(), py::keep_alive<1, 2>(),
             py::keep_alive<1, 3>());
     // TODO: encoder_begin_callback and logits_filter_callback are still missing
+
+    py::class_<ParamsSnapshot>(m, "ParamsSnapshot",
+                               "Frozen copy of Params, safe to share between "
+                               "threads")
+        .def(py::init<const Params &>(), "params"_a)
+        .def_property_readonly("decoding_hash", &ParamsSnapshot::decoding_hash)
+        .def("__hash__",
+             [](const ParamsSnapshot &self) {
+                 // python hashes are Py_ssize_t
+                 return (py::ssize_t)self.hash();
+             })
+        .def("__eq__",
+             [](const ParamsSnapshot &self, const ParamsSnapshot &other) {
+                 return self == other;
+             });
 }
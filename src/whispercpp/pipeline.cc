@@ -0,0 +1,127 @@
+#include "pipeline.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace whisper {
+
+// Fill in whichever core group was left empty.
+static void split_cpus(int n_states, std::vector<int> *encoder_cpus,
+                       std::vector<int> *decoder_cpus) {
+    if (!encoder_cpus->empty() && !decoder_cpus->empty()) {
+        return;
+    }
+    const std::vector<int> cpus = allowed_cpus();
+    if (cpus.size() < 2) {
+        if (encoder_cpus->empty()) {
+            *encoder_cpus = cpus;
+        }
+        if (decoder_cpus->empty()) {
+            *decoder_cpus = cpus;
+        }
+        return;
+    }
+
+    if (encoder_cpus->empty() && decoder_cpus->empty()) {
+        const size_t n_decoder = std::min(
+            std::max<size_t>(1, (size_t)n_states), cpus.size() / 2);
+        encoder_cpus->assign(cpus.begin(), cpus.end() - n_decoder);
+        decoder_cpus->assign(cpus.end() - n_decoder, cpus.end());
+        return;
+    }
+
+    // only one group given, the other one gets the remaining cpus
+    const std::vector<int> &given =
+        encoder_cpus->empty() ? *decoder_cpus : *encoder_cpus;
+    std::vector<int> *other =
+        encoder_cpus->empty() ? encoder_cpus : decoder_cpus;
+    for (int cpu : cpus) {
+        if (std::find(given.begin(), given.end(), cpu) == given.end()) {
+            other->push_back(cpu);
+        }
+    }
+    if (other->empty()) {
+        *other = cpus;
+    }
+}
+
+PipelineScheduler::PipelineScheduler(Context &context, int n_states,
+                                     std::vector<int> encoder_cpus,
+                                     std::vector<int> decoder_cpus) {
+    if (n_states < 1) {
+        throw std::invalid_argument("n_states must be >= 1");
+    }
+    split_cpus(n_states, &encoder_cpus, &decoder_cpus);
+    m_stages.reset(new PipelineStages(std::move(encoder_cpus),
+                                      std::move(decoder_cpus), 1, n_states));
+
+    // NOTE: reserved up front, m_free points into m_states
+    m_states.reserve(n_states);
+    for (int i = 0; i < n_states; ++i) {
+        m_states.push_back(context.clone_with_state());
+        m_free.push_back(&m_states.back());
+    }
+}
+
+PipelineScheduler::~PipelineScheduler() {
+    for (Context &state : m_states) {
+        state.free_state();
+    }
+}
+
+Context *PipelineScheduler::acquire() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_cv.wait(lock, [this]() { return !m_free.empty(); });
+    Context *state = m_free.back();
+    m_free.pop_back();
+    return state;
+}
+
+void PipelineScheduler::release(Context *state) {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_free.push_back(state);
+    }
+    m_cv.notify_one();
+}
+
+std::vector<PipelineScheduler::Segment>
+PipelineScheduler::transcribe(Params params, std::vector<float> data) {
+    Context *state = acquire();
+    std::vector<Segment> segments;
+    try {
+        // each state decodes on a slice of its own
+        PipelineStages::Scope scope(m_stages.get(),
+                                    (int)(state - m_states.data()));
+        state->full(params, std::move(data));
+        segments = state->full_segments();
+    } catch (...) {
+        release(state);
+        throw;
+    }
+    release(state);
+    return segments;
+}
+
+} // namespace whisper
+
+void ExportPipelineApi(py::module &m) {
+    py::class_<whisper::PipelineScheduler>(
+        m, "PipelineScheduler",
+        "Concurrent requests over several states of one context, with "
+        "encoders and decoders on separate core groups")
+        .def(py::init<Context &, int, std::vector<int>, std::vector<int>>(),
+             "context"_a, "n_states"_a = 2,
+             "encoder_cpus"_a = std::vector<int>(),
+             "decoder_cpus"_a = std::vector<int>(), py::keep_alive<1, 2>())
+        .def("transcribe", &whisper::PipelineScheduler::transcribe,
+             "params"_a, "data"_a, py::call_guard<py::gil_scoped_release>())
+        .def_property_readonly("n_states",
+                               &whisper::PipelineScheduler::n_states)
+        .def_property_readonly("encoder_cpus",
+                               &whisper::PipelineScheduler::encoder_cpus)
+        .def_property_readonly("decoder_cpus",
+                               &whisper::PipelineScheduler::decoder_cpus)
+        .def_property_readonly("decoder_slices",
+                               &whisper::PipelineScheduler::decoder_slices);
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include "context.h"
+#include "threadpool.h"
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <vector>
+
+namespace whisper {
+
+// Runs concurrent requests against one model on a fixed set of states,
+// with the encoder and decoder of every request on separate core groups
+// (see PipelineStages). While one request encodes on the encoder cpus, the
+// others keep decoding on the decoder cpus instead of all of them
+// competing for the same cores. transcribe() is meant to be called from
+// several threads at once; a call waits for a free state if all n_states
+// are busy.
+class PipelineScheduler {
+  public:
+    typedef Context::Segment Segment;
+
+    // Empty cpu groups are derived from the process affinity mask: the
+    // decoder group gets one cpu per state, up to half of the cpus, and
+    // the encoder group the rest. Each state decodes on its own slice of
+    // the decoder group.
+    PipelineScheduler(Context &context, int n_states,
+                      std::vector<int> encoder_cpus = {},
+                      std::vector<int> decoder_cpus = {});
+    ~PipelineScheduler();
+
+    PipelineScheduler(const PipelineScheduler &) = delete;
+    PipelineScheduler &operator=(const PipelineScheduler &) = delete;
+
+    std::vector<Segment> transcribe(Params params, std::vector<float> data);
+
+    int n_states() const { return (int)m_states.size(); }
+    const std::vector<int> &encoder_cpus() const {
+        return m_stages->cpus(COMPUTE_PHASE_ENCODER);
+    }
+    const std::vector<int> &decoder_cpus() const {
+        return m_stages->cpus(COMPUTE_PHASE_DECODER);
+    }
+    // Decoder cpus of every state, see PipelineStages::decoder_slice.
+    std::vector<std::vector<int>> decoder_slices() const {
+        std::vector<std::vector<int>> out;
+        for (int i = 0; i < m_stages->n_decoder_slices(); ++i) {
+            out.push_back(m_stages->decoder_slice(i));
+        }
+        return out;
+    }
+
+  private:
+    Context *acquire();
+    void release(Context *state);
+
+    std::unique_ptr<PipelineStages> m_stages;
+    std::vector<Context> m_states;
+
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::vector<Context *> m_free;
+};
+
+} // namespace whisper
+
+void ExportPipelineApi(py::module &m);
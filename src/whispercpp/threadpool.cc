@@ -0,0 +1,628 @@
+#include "threadpool.h"
+#ifdef BAZEL_BUILD
+#include "pybind11/stl.h"
+#else
+#include "pybind11/stl.h"
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <stdexcept>
+#include <thread>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__)
+#include <immintrin.h>
+#define CPU_RELAX() _mm_pause()
+#else
+#define CPU_RELAX() std::this_thread::yield()
+#endif
+
+namespace py = pybind11;
+using namespace pybind11::literals;
+
+namespace whisper {
+
+enum WorkerState {
+    WORKER_IDLE = 0,
+    WORKER_ASSIGNED = 1,
+    WORKER_DONE = 2,
+};
+
+#ifdef __linux__
+static void set_cpus(pthread_t thread, const std::vector<int> &cpus) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus) {
+        CPU_SET(cpu, &set);
+    }
+    pthread_setaffinity_np(thread, sizeof(set), &set);
+}
+#endif
+
+#ifdef __linux__
+// cpus allowed by a CFS quota, 0 if there is none.
+static int cgroup_quota_cpus() {
+    // cgroup v2: "<quota> <period>" or "max <period>"
+    {
+        std::ifstream file("/sys/fs/cgroup/cpu.max");
+        std::string quota;
+        long period = 0;
+        if (file >> quota >> period) {
+            if (quota == "max" || period <= 0) {
+                return 0;
+            }
+            return (int)std::ceil((double)std::atol(quota.c_str()) / period);
+        }
+    }
+    // cgroup v1, a quota of -1 means unlimited
+    std::ifstream quota_file("/sys/fs/cgroup/cpu/cpu.cfs_quota_us");
+    std::ifstream period_file("/sys/fs/cgroup/cpu/cpu.cfs_period_us");
+    long quota = -1;
+    long period = 0;
+    if (quota_file >> quota && period_file >> period && quota > 0 &&
+        period > 0) {
+        return (int)std::ceil((double)quota / period);
+    }
+    return 0;
+}
+#endif
+
+std::vector<int> allowed_cpus() {
+    std::vector<int> cpus;
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (CPU_ISSET(cpu, &set)) {
+                cpus.push_back(cpu);
+            }
+        }
+    }
+#endif
+    if (cpus.empty()) {
+        const unsigned n_cpus =
+            std::max(1u, std::thread::hardware_concurrency());
+        for (unsigned i = 0; i < n_cpus; ++i) {
+            cpus.push_back(i);
+        }
+    }
+    return cpus;
+}
+
+int effective_cpus() {
+    int n_cpus = (int)allowed_cpus().size();
+#ifdef __linux__
+    const int quota = cgroup_quota_cpus();
+    if (quota > 0) {
+        n_cpus = std::min(n_cpus, quota);
+    }
+#endif
+    return std::max(1, n_cpus);
+}
+
+NumaTopology::NumaTopology() {
+#ifdef __linux__
+    for (int node = 0;; ++node) {
+        char path[64];
+        snprintf(path, sizeof(path),
+                 "/sys/devices/system/node/node%d/cpulist", node);
+        std::ifstream file(path);
+        std::string list;
+        if (!file || !std::getline(file, list)) {
+            break;
+        }
+        m_cpus.push_back(parse_cpulist(list));
+    }
+#endif
+    if (m_cpus.empty()) {
+        std::vector<int> all;
+        const unsigned n_cpus =
+            std::max(1u, std::thread::hardware_concurrency());
+        for (unsigned i = 0; i < n_cpus; ++i) {
+            all.push_back(i);
+        }
+        m_cpus.push_back(all);
+    }
+}
+
+const NumaTopology &NumaTopology::get() {
+    static NumaTopology topology;
+    return topology;
+}
+
+const std::vector<int> &NumaTopology::cpus(int node) const {
+    static const std::vector<int> empty;
+    if (node < 0 || node >= n_nodes()) {
+        return empty;
+    }
+    return m_cpus[node];
+}
+
+std::vector<int> NumaTopology::parse_cpulist(const std::string &list) {
+    std::vector<int> cpus;
+    const char *p = list.c_str();
+    while (*p != '\0') {
+        char *end;
+        const long first = std::strtol(p, &end, 10);
+        if (end == p) {
+            break;
+        }
+        long last = first;
+        if (*end == '-') {
+            p = end + 1;
+            last = std::strtol(p, &end, 10);
+        }
+        for (long cpu = first; cpu <= last; ++cpu) {
+            cpus.push_back((int)cpu);
+        }
+        p = (*end == ',') ? end + 1 : end;
+    }
+    return cpus;
+}
+
+static thread_local const std::vector<int> *g_cpus = nullptr;
+
+ScopedCpuSet::ScopedCpuSet(const std::vector<int> &cpus) : m_prev(g_cpus) {
+    if (cpus.empty()) {
+        return;
+    }
+#ifdef __linux__
+    pthread_getaffinity_np(pthread_self(), sizeof(m_saved), &m_saved);
+    set_cpus(pthread_self(), cpus);
+    m_bound = true;
+#endif
+    g_cpus = &cpus;
+}
+
+ScopedCpuSet::~ScopedCpuSet() {
+#ifdef __linux__
+    if (m_bound) {
+        pthread_setaffinity_np(pthread_self(), sizeof(m_saved), &m_saved);
+    }
+#endif
+    g_cpus = m_prev;
+}
+
+const std::vector<int> *ScopedCpuSet::current() { return g_cpus; }
+
+static thread_local int g_numa_node = -1;
+
+static const std::vector<int> &numa_node_cpus(int node) {
+    static const std::vector<int> none;
+    if (node < 0) {
+        return none;
+    }
+    const std::vector<int> &cpus = NumaTopology::get().cpus(node);
+    if (cpus.empty()) {
+        throw std::invalid_argument("NUMA node " + std::to_string(node) +
+                                    " does not exist");
+    }
+    return cpus;
+}
+
+ScopedNumaNode::ScopedNumaNode(int node)
+    : m_prev(g_numa_node), m_cpus(numa_node_cpus(node)) {
+    if (node >= 0) {
+        g_numa_node = node;
+    }
+}
+
+ScopedNumaNode::~ScopedNumaNode() { g_numa_node = m_prev; }
+
+int ScopedNumaNode::current() { return g_numa_node; }
+
+struct ThreadPool::Worker {
+    size_t index = 0;
+    std::thread thread;
+    // cpus the worker's affinity is currently set to, empty for the pool
+    // policy. Compared by value, the caller's set may not outlive the task.
+    // Guarded by the pool's m_mutex.
+    std::vector<int> cpus;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::atomic<int> state{WORKER_IDLE};
+
+    void *(*fn)(void *) = nullptr;
+    void *arg = nullptr;
+    void *result = nullptr;
+
+    // Transitions are published under the mutex so that a thread that gave
+    // up spinning can block on cv without missing a wakeup.
+    void set(int next) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            state.store(next, std::memory_order_release);
+        }
+        cv.notify_all();
+    }
+
+    // Spin for spin_us, then block until state == target.
+    void wait(int target, int spin_us) {
+        const auto deadline = std::chrono::steady_clock::now() +
+                              std::chrono::microseconds(spin_us);
+        while (state.load(std::memory_order_acquire) != target) {
+            if (std::chrono::steady_clock::now() >= deadline) {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [this, target]() {
+                    return state.load(std::memory_order_acquire) == target;
+                });
+                return;
+            }
+            CPU_RELAX();
+        }
+    }
+};
+
+ThreadPool &ThreadPool::global() {
+    // NOTE: intentionally leaked, parked workers must outlive any static
+    // destructor that could still be computing a graph at exit.
+    static ThreadPool *pool = new ThreadPool();
+    return *pool;
+}
+
+void ThreadPool::set_policy(int spin_us, bool pin_threads) {
+    if (spin_us < 0) {
+        throw std::invalid_argument("spin_us must be >= 0");
+    }
+    m_spin_us.store(spin_us, std::memory_order_relaxed);
+    m_pin.store(pin_threads, std::memory_order_relaxed);
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (Worker *worker : m_workers) {
+        if (worker->cpus.empty()) {
+            pin(worker);
+        }
+    }
+}
+
+size_t ThreadPool::size() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_workers.size();
+}
+
+void ThreadPool::bind(Worker *worker, const std::vector<int> *cpus) {
+    if (cpus == nullptr) {
+        if (!worker->cpus.empty()) {
+            worker->cpus.clear();
+            pin(worker);
+        }
+        return;
+    }
+    if (worker->cpus == *cpus) {
+        return;
+    }
+    worker->cpus = *cpus;
+#ifdef __linux__
+    set_cpus(worker->thread.native_handle(), *cpus);
+#endif
+}
+
+void ThreadPool::pin(Worker *worker) {
+#ifdef __linux__
+    // NOTE: only cpus the process may run on, core indices past the
+    // affinity mask (taskset, cgroup cpusets) would be refused
+    const std::vector<int> *scoped = ScopedCpuSet::current();
+    const std::vector<int> cpus =
+        scoped != nullptr ? *scoped : allowed_cpus();
+    if (pin_threads()) {
+        set_cpus(worker->thread.native_handle(),
+                 std::vector<int>(1, cpus[worker->index % cpus.size()]));
+    } else {
+        set_cpus(worker->thread.native_handle(), cpus);
+    }
+#else
+    (void)worker;
+#endif
+}
+
+ThreadPool::Worker *ThreadPool::acquire(const std::vector<int> *cpus) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    Worker *worker;
+    if (!m_idle.empty()) {
+        // NOTE: prefer a worker already bound to cpus, so steady streams of
+        // graphs on the same cpus (a decoder slice) never rebind a worker
+        std::vector<Worker *>::iterator it = m_idle.end() - 1;
+        if (cpus != nullptr) {
+            for (std::vector<Worker *>::iterator w = m_idle.end();
+                 w != m_idle.begin();) {
+                --w;
+                if ((*w)->cpus == *cpus) {
+                    it = w;
+                    break;
+                }
+            }
+        }
+        worker = *it;
+        m_idle.erase(it);
+    } else {
+        worker = new Worker();
+        worker->index = m_workers.size();
+        worker->thread = std::thread(&ThreadPool::loop, this, worker);
+        m_workers.push_back(worker);
+        if (pin_threads()) {
+            pin(worker);
+        }
+    }
+    // NOTE: the worker is idle, so its affinity can be changed from here.
+    bind(worker, cpus);
+    return worker;
+}
+
+void ThreadPool::loop(Worker *worker) {
+    for (;;) {
+        worker->wait(WORKER_ASSIGNED, spin_us());
+        worker->result = worker->fn(worker->arg);
+        worker->set(WORKER_DONE);
+    }
+}
+
+void *ThreadPool::run(void *(*fn)(void *), void *arg) {
+    Worker *worker = acquire(ScopedCpuSet::current());
+    worker->fn = fn;
+    worker->arg = arg;
+    worker->result = nullptr;
+    worker->set(WORKER_ASSIGNED);
+    return worker;
+}
+
+void *ThreadPool::join(void *task) {
+    Worker *worker = static_cast<Worker *>(task);
+    worker->wait(WORKER_DONE, spin_us());
+    void *result = worker->result;
+    worker->state.store(WORKER_IDLE, std::memory_order_relaxed);
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_idle.push_back(worker);
+    return result;
+}
+
+CpuBudget::CpuBudget() { m_n_cores = effective_cpus(); }
+
+CpuBudget &CpuBudget::global() {
+    static CpuBudget *budget = new CpuBudget();
+    return *budget;
+}
+
+void CpuBudget::configure(int n_cores, bool elastic) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_n_cores = n_cores == 0 ? effective_cpus() : n_cores;
+    m_elastic = elastic;
+}
+
+int CpuBudget::n_cores() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_n_cores;
+}
+
+bool CpuBudget::elastic() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_elastic;
+}
+
+int CpuBudget::active() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_n_active;
+}
+
+void CpuBudget::acquire(int requested) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    ++m_active[requested];
+    ++m_n_active;
+}
+
+void CpuBudget::release(int requested) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_active.find(requested);
+    if (it == m_active.end()) {
+        return;
+    }
+    if (--it->second == 0) {
+        m_active.erase(it);
+    }
+    --m_n_active;
+}
+
+void CpuBudget::update(int from, int to) {
+    if (from == to) {
+        return;
+    }
+    release(from);
+    acquire(to);
+}
+
+int CpuBudget::share(int requested) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_n_cores < 0 || m_n_active == 0) {
+        return std::max(1, requested);
+    }
+
+    // Water-filling: walk the requests from the smallest up, each one takes
+    // min(requested, equal split of what is left).
+    int level = m_n_cores / m_n_active;
+    if (!m_elastic) {
+        int remaining = m_n_cores;
+        int n_left = m_n_active;
+        for (const auto &entry : m_active) {
+            const int fair = remaining / n_left;
+            if (entry.first > fair) {
+                level = fair;
+                break;
+            }
+            remaining -= entry.first * entry.second;
+            n_left -= entry.second;
+            level = n_left > 0 ? remaining / n_left : m_n_cores;
+        }
+        return std::max(1, std::min(requested, level));
+    }
+    return std::max(1, level);
+}
+
+static thread_local CpuLease *g_current_lease = nullptr;
+
+CpuLease::CpuLease(int requested, int encoder_threads, int decoder_threads)
+    : m_n_threads(requested), m_encoder_threads(encoder_threads),
+      m_decoder_threads(decoder_threads), m_requested(requested) {
+    CpuBudget::global().acquire(m_requested);
+    m_prev = g_current_lease;
+    g_current_lease = this;
+}
+
+CpuLease::~CpuLease() {
+    g_current_lease = m_prev;
+    CpuBudget::global().release(m_requested);
+}
+
+int CpuLease::threads(ComputePhase phase) {
+    int requested = m_n_threads;
+    if (phase == COMPUTE_PHASE_ENCODER && m_encoder_threads > 0) {
+        requested = m_encoder_threads;
+    } else if (phase == COMPUTE_PHASE_DECODER && m_decoder_threads > 0) {
+        requested = m_decoder_threads;
+    }
+    CpuBudget::global().update(m_requested, requested);
+    m_requested = requested;
+    return threads();
+}
+
+CpuLease *CpuLease::current() { return g_current_lease; }
+
+PipelineStages::PipelineStages(std::vector<int> encoder_cpus,
+                               std::vector<int> decoder_cpus,
+                               int encoder_slots, int n_decoder_slices)
+    : m_encoder_cpus(std::move(encoder_cpus)),
+      m_decoder_cpus(std::move(decoder_cpus)),
+      m_encoder_slots(std::max(1, encoder_slots)) {
+    const size_t n_cpus = m_decoder_cpus.size();
+    const size_t n_slices = (size_t)std::max(1, n_decoder_slices);
+    m_decoder_slices.resize(n_slices);
+    for (size_t i = 0; i < n_slices && n_cpus > 0; ++i) {
+        if (n_cpus < n_slices) {
+            m_decoder_slices[i].push_back(m_decoder_cpus[i % n_cpus]);
+            continue;
+        }
+        m_decoder_slices[i].assign(
+            m_decoder_cpus.begin() + i * n_cpus / n_slices,
+            m_decoder_cpus.begin() + (i + 1) * n_cpus / n_slices);
+    }
+}
+
+const std::vector<int> &PipelineStages::cpus(ComputePhase phase) const {
+    return phase == COMPUTE_PHASE_DECODER ? m_decoder_cpus : m_encoder_cpus;
+}
+
+const std::vector<int> &PipelineStages::decoder_slice(int slice) const {
+    return m_decoder_slices[(size_t)slice % m_decoder_slices.size()];
+}
+
+PipelineStages::EncoderTurn::EncoderTurn(PipelineStages &stages)
+    : m_stages(stages) {
+    std::unique_lock<std::mutex> lock(stages.m_mutex);
+    const uint64_t ticket = stages.m_next_ticket++;
+    stages.m_cv.wait(lock, [&stages, ticket]() {
+        return ticket < stages.m_n_left + (uint64_t)stages.m_encoder_slots;
+    });
+}
+
+PipelineStages::EncoderTurn::~EncoderTurn() {
+    {
+        std::lock_guard<std::mutex> lock(m_stages.m_mutex);
+        ++m_stages.m_n_left;
+    }
+    m_stages.m_cv.notify_all();
+}
+
+static thread_local PipelineStages *g_current_stages = nullptr;
+static thread_local int g_current_slice = 0;
+
+PipelineStages::Scope::Scope(PipelineStages *stages, int decoder_slice)
+    : m_prev(g_current_stages), m_prev_slice(g_current_slice) {
+    g_current_stages = stages;
+    g_current_slice = decoder_slice;
+}
+
+PipelineStages::Scope::~Scope() {
+    g_current_stages = m_prev;
+    g_current_slice = m_prev_slice;
+}
+
+PipelineStages *PipelineStages::current() { return g_current_stages; }
+
+const std::vector<int> &
+PipelineStages::current_cpus(ComputePhase phase) const {
+    return phase == COMPUTE_PHASE_DECODER ? decoder_slice(g_current_slice)
+                                          : m_encoder_cpus;
+}
+
+} // namespace whisper
+
+#ifndef _WIN32
+int whisper_cpp2py_thread_create(pthread_t *thread, const pthread_attr_t *attr,
+                                 void *(*fn)(void *), void *arg) {
+    (void)attr;
+    void *task = whisper::ThreadPool::global().run(fn, arg);
+    *thread = reinterpret_cast<pthread_t>(task);
+    return 0;
+}
+
+int whisper_cpp2py_thread_join(pthread_t thread, void **result) {
+    void *ret = whisper::ThreadPool::global().join(
+        reinterpret_cast<void *>(thread));
+    if (result != nullptr) {
+        *result = ret;
+    }
+    return 0;
+}
+#endif
+
+void ExportThreadPoolApi(py::module &m) {
+    m.def(
+        "set_thread_pool_policy",
+        [](int spin_us, bool pin_threads) {
+            whisper::ThreadPool::global().set_policy(spin_us, pin_threads);
+        },
+        "spin_us"_a = 50, "pin_threads"_a = false,
+        "Configure the worker pool shared by every graph compute. Idle "
+        "workers spin for 'spin_us' microseconds before sleeping, and are "
+        "pinned to one core each if 'pin_threads' is set.");
+    m.def(
+        "thread_pool_size",
+        []() { return whisper::ThreadPool::global().size(); },
+        "Number of worker threads owned by the pool.");
+    m.def(
+        "set_cpu_budget",
+        [](int n_cores, bool elastic) {
+            whisper::CpuBudget::global().configure(n_cores, elastic);
+        },
+        "n_cores"_a = 0, "elastic"_a = false,
+        "Set the number of cores shared by all concurrent requests. 0 uses "
+        "every cpu available to the process (affinity mask and cgroup "
+        "quota) and a negative value disables the budget, "
+        "letting each request use its own 'n_threads'. With 'elastic' a "
+        "request may use more than its 'n_threads' when cores are idle.");
+    m.def(
+        "get_cpu_budget",
+        []() { return whisper::CpuBudget::global().n_cores(); },
+        "Number of cores shared by concurrent requests, negative if "
+        "disabled.");
+    m.def(
+        "numa_nodes",
+        []() {
+            const whisper::NumaTopology &topology = whisper::NumaTopology::get();
+            std::vector<std::vector<int>> nodes;
+            for (int node = 0; node < topology.n_nodes(); ++node) {
+                nodes.push_back(topology.cpus(node));
+            }
+            return nodes;
+        },
+        "CPUs of each NUMA node, indexed by node id.");
+    m.def("effective_cpus", &whisper::effective_cpus,
+          "Number of cpus available to the process, taking the affinity "
+          "mask and cgroup CPU quota into account.");
+}
@@ -0,0 +1,294 @@
+#pragma once
+
+// ggml starts and joins n_threads - 1 worker threads on every graph compute.
+// ggml.c is compiled by the binding (see ggml_threadpool.c) with
+// pthread_create/pthread_join redirected to the functions below, so those
+// workers are handed to threads parked in a process-wide pool instead.
+#ifndef _WIN32
+#include <pthread.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int whisper_cpp2py_thread_create(pthread_t *thread, const pthread_attr_t *attr,
+                                 void *(*fn)(void *), void *arg);
+int whisper_cpp2py_thread_join(pthread_t thread, void **result);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
+
+#ifdef __cplusplus
+#ifdef BAZEL_BUILD
+#include "pybind11/pybind11.h"
+#else
+#include "pybind11/pybind11.h"
+#endif
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace whisper {
+
+// cpus in the process affinity mask.
+std::vector<int> allowed_cpus();
+
+// Number of cpus this process may actually use: the affinity mask, capped
+// by the cgroup CPU quota (cgroup v2 cpu.max or v1 cfs_quota_us) if any.
+int effective_cpus();
+
+// NUMA nodes and their cpus, read from /sys/devices/system/node on Linux.
+// Everywhere else (or without sysfs) this is a single node with every cpu.
+class NumaTopology {
+  public:
+    static const NumaTopology &get();
+
+    int n_nodes() const { return (int)m_cpus.size(); }
+    // cpus of the given node, empty if the node does not exist
+    const std::vector<int> &cpus(int node) const;
+
+    // Parse a sysfs cpulist such as "0-7,16-23".
+    static std::vector<int> parse_cpulist(const std::string &list);
+
+  private:
+    NumaTopology();
+
+    std::vector<std::vector<int>> m_cpus;
+};
+
+// Restrict the calling thread to a set of cpus for the lifetime of this
+// object. Pool workers picking up graph computes from this thread run on
+// the same cpus. An empty set does nothing. cpus must outlive the object.
+class ScopedCpuSet {
+  public:
+    explicit ScopedCpuSet(const std::vector<int> &cpus);
+    ~ScopedCpuSet();
+
+    ScopedCpuSet(const ScopedCpuSet &) = delete;
+    ScopedCpuSet &operator=(const ScopedCpuSet &) = delete;
+
+    // cpus the calling thread is bound to, nullptr if none.
+    static const std::vector<int> *current();
+
+  private:
+    const std::vector<int> *m_prev;
+    bool m_bound = false;
+#ifdef __linux__
+    cpu_set_t m_saved;
+#endif
+};
+
+// Restrict the calling thread to the cpus of a NUMA node for the lifetime
+// of this object. Pool workers picking up graph computes from this thread
+// move to the same node. A negative node does nothing.
+class ScopedNumaNode {
+  public:
+    explicit ScopedNumaNode(int node);
+    ~ScopedNumaNode();
+
+    ScopedNumaNode(const ScopedNumaNode &) = delete;
+    ScopedNumaNode &operator=(const ScopedNumaNode &) = delete;
+
+    // Node the calling thread is bound to, -1 if none.
+    static int current();
+
+  private:
+    int m_prev;
+    ScopedCpuSet m_cpus;
+};
+
+class ThreadPool {
+  public:
+    static ThreadPool &global();
+
+    // How long an idle worker (or a thread waiting on one) spins before
+    // blocking, and whether workers are pinned to a core each.
+    void set_policy(int spin_us, bool pin_threads);
+    int spin_us() const { return m_spin_us.load(std::memory_order_relaxed); }
+    bool pin_threads() const { return m_pin.load(std::memory_order_relaxed); }
+
+    // Number of threads owned by the pool, busy or parked.
+    size_t size();
+
+    // Run fn(arg) on a parked worker. A task is never queued: when every
+    // worker is busy a new one is spawned, since ggml workers spin waiting
+    // on each other and would deadlock behind one another.
+    void *run(void *(*fn)(void *), void *arg);
+    // Wait for a task returned by run() and hand its worker back.
+    void *join(void *task);
+
+  private:
+    struct Worker;
+
+    ThreadPool() = default;
+
+    // Take a parked worker, or spawn one, bound to cpus (see
+    // ScopedCpuSet::current).
+    Worker *acquire(const std::vector<int> *cpus);
+    // pin and bind are called with m_mutex held.
+    void pin(Worker *worker);
+    void bind(Worker *worker, const std::vector<int> *cpus);
+    void loop(Worker *worker);
+
+    std::mutex m_mutex;
+    std::vector<Worker *> m_workers;
+    std::vector<Worker *> m_idle;
+
+    std::atomic<int> m_spin_us{50};
+    std::atomic<bool> m_pin{false};
+};
+
+// Process-wide number of cores handed out to concurrent requests. Every
+// active request holds a CpuLease for the n_threads it asked for, and each
+// graph compute runs with the lease's current max-min fair share of the
+// budget: requests asking for less than an equal split keep what they asked
+// for, the rest split what is left. Shares shrink as requests arrive and
+// grow back as they finish.
+class CpuBudget {
+  public:
+    static CpuBudget &global();
+
+    // n_cores = 0 uses effective_cpus(), n_cores < 0 disables the
+    // budget. With elastic = true requests may also grow past their own
+    // n_threads when cores are idle.
+    void configure(int n_cores, bool elastic);
+    int n_cores();
+    bool elastic();
+    // Number of requests currently holding a lease.
+    int active();
+
+    void acquire(int requested);
+    void release(int requested);
+    void update(int from, int to);
+    // Threads a request that asked for 'requested' may use right now.
+    int share(int requested);
+
+  private:
+    CpuBudget();
+
+    std::mutex m_mutex;
+    int m_n_cores;
+    bool m_elastic = false;
+    // requested n_threads -> number of active leases asking for it
+    std::map<int, int> m_active;
+    int m_n_active = 0;
+};
+
+enum ComputePhase {
+    COMPUTE_PHASE_ANY = 0,
+    COMPUTE_PHASE_ENCODER,
+    COMPUTE_PHASE_DECODER,
+};
+
+// RAII registration of the calling thread's request with the CpuBudget.
+// Graph computes issued from this thread use the lease's share.
+class CpuLease {
+  public:
+    // encoder_threads/decoder_threads > 0 replace 'requested' while the
+    // request is in that phase, see threads(phase).
+    explicit CpuLease(int requested, int encoder_threads = 0,
+                      int decoder_threads = 0);
+    ~CpuLease();
+
+    CpuLease(const CpuLease &) = delete;
+    CpuLease &operator=(const CpuLease &) = delete;
+
+    int threads() const { return CpuBudget::global().share(m_requested); }
+    // Switch the lease to the thread count of the given phase, and return
+    // its share. The budget sees the new request right away, so cores a
+    // request stops using in one phase go to the others.
+    int threads(ComputePhase phase);
+
+    // Lease held by the calling thread, nullptr if none.
+    static CpuLease *current();
+
+  private:
+    int m_n_threads;
+    int m_encoder_threads;
+    int m_decoder_threads;
+    int m_requested;
+    CpuLease *m_prev;
+};
+
+// Encoder and decoder core groups for stage-pipelined requests. Graph
+// computes issued under a PipelineStages::Scope run on the group of their
+// phase. Encoder graphs also wait for one of encoder_slots turns on the
+// encoder group, in arrival order, so while one request encodes on all of
+// the encoder cpus the others keep decoding on the decoder cpus. The
+// decoder group is split into n_decoder_slices disjoint slices, and a
+// scope decodes on its own slice only, so requests decoding at once don't
+// start more threads than the group has cpus.
+class PipelineStages {
+  public:
+    PipelineStages(std::vector<int> encoder_cpus,
+                   std::vector<int> decoder_cpus, int encoder_slots = 1,
+                   int n_decoder_slices = 1);
+
+    PipelineStages(const PipelineStages &) = delete;
+    PipelineStages &operator=(const PipelineStages &) = delete;
+
+    const std::vector<int> &cpus(ComputePhase phase) const;
+    int encoder_slots() const { return m_encoder_slots; }
+    // Decoder cpus of the given slice. With fewer cpus than slices, slices
+    // share a single cpu each.
+    const std::vector<int> &decoder_slice(int slice) const;
+    int n_decoder_slices() const { return (int)m_decoder_slices.size(); }
+
+    // Holds an encoder turn for its lifetime.
+    class EncoderTurn {
+      public:
+        explicit EncoderTurn(PipelineStages &stages);
+        ~EncoderTurn();
+
+        EncoderTurn(const EncoderTurn &) = delete;
+        EncoderTurn &operator=(const EncoderTurn &) = delete;
+
+      private:
+        PipelineStages &m_stages;
+    };
+
+    // Route graph computes from the calling thread through stages for the
+    // lifetime of this object, decoding on the given decoder slice.
+    class Scope {
+      public:
+        explicit Scope(PipelineStages *stages, int decoder_slice = 0);
+        ~Scope();
+
+        Scope(const Scope &) = delete;
+        Scope &operator=(const Scope &) = delete;
+
+      private:
+        PipelineStages *m_prev;
+        int m_prev_slice;
+    };
+
+    // Stages of the calling thread, nullptr if none.
+    static PipelineStages *current();
+    // cpus graphs of the given phase run on, for the calling thread's scope.
+    const std::vector<int> &current_cpus(ComputePhase phase) const;
+
+  private:
+    std::vector<int> m_encoder_cpus;
+    std::vector<int> m_decoder_cpus;
+    std::vector<std::vector<int>> m_decoder_slices;
+    int m_encoder_slots;
+
+    // ticket lock: a ticket may enter once fewer than encoder_slots
+    // earlier tickets are still inside
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    uint64_t m_next_ticket = 0;
+    uint64_t m_n_left = 0;
+};
+
+} // namespace whisper
+
+void ExportThreadPoolApi(pybind11::module &m);
+#endif
@@ -63,3 +63,625 @@ def test_from_buffer(
     with open(models, "rb") as f:
         context = w.api.Context.from_buffer(f.read())
         assert not context.full(params, audio_file)
+
+
+def test_thread_pool_reused_across_calls(audio_file: NDArray[np.float32]):
+    w.api.set_thread_pool_policy(spin_us=0)
+    params = (
+        w.api.Params.from_enum(w.api.SAMPLING_GREEDY)
+        .with_print_progress(False)
+        .with_num_threads(4)
+        .build()
+    )
+    context = w.api.Context.from_file(w.utils.download_model("tiny.en"))
+    assert not context.full(params, audio_file)
+    size = w.api.thread_pool_size()
+    assert size >= 3
+    assert not context.full(params, audio_file)
+    assert w.api.thread_pool_size() == size
+    w.api.set_thread_pool_policy()
+
+    # pinned workers only take cpus the process may run on
+    import os
+
+    if hasattr(os, "sched_setaffinity"):
+        mask = os.sched_getaffinity(0)
+        os.sched_setaffinity(0, {max(mask)})
+        try:
+            w.api.set_thread_pool_policy(spin_us=0, pin_threads=True)
+            assert not context.full(params, audio_file)
+        finally:
+            os.sched_setaffinity(0, mask)
+            w.api.set_thread_pool_policy()
+
+    with pytest.raises(ValueError):
+        w.api.set_thread_pool_policy(spin_us=-1)
+
+
+def test_cpu_budget(params: w.api.Params, audio_file: NDArray[np.float32]):
+    context = w.api.Context.from_file(w.utils.download_model("tiny.en"))
+    assert not context.full(params, audio_file)
+
+    w.api.set_cpu_budget(1)
+    assert w.api.get_cpu_budget() == 1
+    assert not context.full(params.with_num_threads(4), audio_file)
+
+    w.api.set_cpu_budget(-1)
+    assert w.api.get_cpu_budget() == -1
+    assert not context.full(params, audio_file)
+
+    w.api.set_cpu_budget()
+    assert w.api.get_cpu_budget() > 0
+
+
+def test_numa_node_placement(
+    params: w.api.Params, audio_file: NDArray[np.float32]
+):
+    nodes = w.api.numa_nodes()
+    assert len(nodes) >= 1 and all(len(cpus) > 0 for cpus in nodes)
+
+    context = w.api.Context.from_file(w.utils.download_model("tiny.en"), True)
+    context.init_state(numa_node=len(nodes) - 1)
+    assert not context.full(params, audio_file)
+    assert not context.full(params.with_numa_node(0), audio_file)
+    assert params.numa_node == 0
+
+    with pytest.raises(ValueError):
+        context.full(params.with_numa_node(len(nodes)), audio_file)
+    params.with_numa_node(-1)
+
+
+def test_encoder_decoder_threads(audio_file: NDArray[np.float32]):
+    params = (
+        w.api.Params.from_enum(w.api.SAMPLING_GREEDY)
+        .with_print_progress(False)
+        .with_encoder_threads(4)
+        .with_decoder_threads(1)
+        .build()
+    )
+    assert params.encoder_threads == 4
+    assert params.decoder_threads == 1
+    assert "encoder_threads=4" in repr(params)
+
+    context = w.api.Context.from_file(w.utils.download_model("tiny.en"))
+    assert not context.full(params, audio_file)
+    assert context.full_n_segments() > 0
+
+
+def test_autotune(tmp_path: p.Path, audio_file: NDArray[np.float32]):
+    import time
+
+    cpus = w.api.effective_cpus()
+    assert 1 <= cpus <= len(sum(w.api.numa_nodes(), []))
+
+    context = w.api.Context.from_file(w.utils.download_model("tiny.en"))
+    profile_path = (tmp_path / "tiny.en.profile").__fspath__()
+    profile = context.autotune(profile_path, max_workers=2)
+    assert not profile.from_cache
+    assert profile.model == context.model_id
+    assert profile.cpus == cpus
+    assert 1 <= profile.n_threads <= cpus
+    assert 1 <= profile.decoder_threads <= cpus
+    assert profile.n_workers in (1, 2)
+    assert profile.encode_ms > 0 and profile.decode_ms > 0
+
+    # the profile timed the encoder itself, not a reused K/V cache: it is
+    # in the range of an encode of real audio on the same threads
+    context.pc_to_mel(audio_file)
+    timings = []
+    for _ in range(3):
+        start = time.perf_counter()
+        context.encode(0, profile.encoder_threads)
+        timings.append((time.perf_counter() - start) * 1e3)
+    assert profile.encode_ms > 0.1 * min(timings)
+
+    cached = context.autotune(profile_path)
+    assert cached.from_cache
+    assert cached.n_threads == profile.n_threads
+    assert cached.n_workers == profile.n_workers
+    assert not context.autotune(profile_path, force=True).from_cache
+
+    assert w.api.TuneProfile.load((tmp_path / "missing").__fspath__()) is None
+
+    params = profile.apply(
+        w.api.Params.from_enum(w.api.SAMPLING_GREEDY).with_print_progress(False)
+    )
+    assert params.encoder_threads == profile.encoder_threads
+    assert not context.full(params, audio_file)
+
+
+def test_pipeline_scheduler(params: w.api.Params, audio_file: NDArray[np.float32]):
+    import concurrent.futures
+
+    context = w.api.Context.from_file(w.utils.download_model("tiny.en"))
+    assert not context.full(params, audio_file)
+    expected = "".join(
+        context.full_get_segment_text(i) for i in range(context.full_n_segments())
+    )
+
+    scheduler = w.api.PipelineScheduler(context, n_states=2)
+    assert scheduler.n_states == 2
+    assert scheduler.encoder_cpus and scheduler.decoder_cpus
+
+    with concurrent.futures.ThreadPoolExecutor(max_workers=3) as pool:
+        futures = [
+            pool.submit(scheduler.transcribe, params, audio_file) for _ in range(3)
+        ]
+        for future in futures:
+            segments = future.result()
+            assert "".join(text for _, _, text in segments) == expected
+            assert all(t0 <= t1 for t0, t1, _ in segments)
+
+    with pytest.raises(ValueError):
+        w.api.PipelineScheduler(context, n_states=0)
+
+
+def test_pipeline_scheduler_concurrent(
+    params: w.api.Params, audio_file: NDArray[np.float32]
+):
+    import threading
+
+    params = params.with_no_context(True).with_num_threads(4)
+    context = w.api.Context.from_file(w.utils.download_model("tiny.en"))
+    assert not context.full(params, audio_file)
+    expected = context.full_segments()
+
+    n_states = 4
+    scheduler = w.api.PipelineScheduler(context, n_states=n_states)
+    slices = scheduler.decoder_slices
+    assert len(slices) == n_states
+    assert all(len(s) >= 1 for s in slices)
+    # states decoding at once never share a decoder cpu when there are
+    # enough of them
+    cpus = sum(slices, [])
+    if len(scheduler.decoder_cpus) >= n_states:
+        assert sorted(cpus) == sorted(scheduler.decoder_cpus)
+    assert set(cpus) <= set(scheduler.decoder_cpus)
+
+    # every request starts at once, and two rounds of them reuse the states
+    n_requests = 2 * n_states
+    start = threading.Barrier(n_requests)
+    results: list[t.Any] = [None] * n_requests
+
+    def request(i: int) -> None:
+        start.wait()
+        try:
+            results[i] = scheduler.transcribe(params, audio_file)
+        except Exception as e:  # noqa: BLE001
+            results[i] = e
+
+    threads = [threading.Thread(target=request, args=(i,)) for i in range(n_requests)]
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
+    assert results == [expected] * n_requests
+
+
+def test_encoder_output_reused(
+    params: w.api.Params, audio_file: NDArray[np.float32]
+):
+    import time
+
+    context = w.api.Context.from_file(w.utils.download_model("tiny.en"))
+    assert not context.full(params, audio_file)
+    expected = [
+        context.full_get_segment_text(i) for i in range(context.full_n_segments())
+    ]
+
+    # the first window was encoded by lang_detect(), full() reuses it
+    context = w.api.Context.from_file(w.utils.download_model("tiny.en"))
+    context.pc_to_mel(audio_file)
+    context.lang_detect(0)
+    assert not context.full(params, audio_file)
+    assert [
+        context.full_get_segment_text(i) for i in range(context.full_n_segments())
+    ] == expected
+
+    # encode() always runs the encoder, and nothing outlives a full() call
+    context.encode(0)
+    start = time.perf_counter()
+    context.encode(0)
+    assert time.perf_counter() - start > 1e-3
+    assert not context.full(params, audio_file)
+    assert [
+        context.full_get_segment_text(i) for i in range(context.full_n_segments())
+    ] == expected
+
+    # a different window on the same state is encoded again
+    assert not context.full(params, audio_file[: len(audio_file) // 2])
+    assert context.full_n_segments() > 0
+    assert not context.full(params, audio_file)
+    assert [
+        context.full_get_segment_text(i) for i in range(context.full_n_segments())
+    ] == expected
+
+
+def test_encoder_output_roundtrip(audio_file: NDArray[np.float32]):
+    import numpy as np
+
+    context = w.api.Context.from_file(w.utils.download_model("tiny.en"))
+    context.pc_to_mel(audio_file)
+    context.encode(0)
+    k, v = context.get_encoder_output()
+    assert k.shape == v.shape == (4, context.n_audio_ctx, 384)
+    k, v = k.copy(), v.copy()
+
+    tokens = [context.sot_token]
+    context.decode(tokens, 0)
+    expected = context.get_logits(0)
+
+    # decode from the exported encoding on a context that never encoded
+    other = w.api.Context.from_file(w.utils.download_model("tiny.en"))
+    other.pc_to_mel(audio_file)
+    other.set_encoder_output(k, v)
+    other.decode(tokens, 0)
+    assert np.allclose(other.get_logits(0), expected)
+
+    with pytest.raises(ValueError):
+        other.set_encoder_output(k[:, :, :10], v[:, :, :10])
+    with pytest.raises(ValueError):
+        other.set_encoder_output(k.astype(np.int16), v.astype(np.int16))
+
+
+def test_full_multi(audio_file: NDArray[np.float32]):
+    def make_params() -> w.api.Params:
+        return (
+            w.api.Params.from_enum(w.api.SAMPLING_GREEDY)
+            .with_print_progress(False)
+            .build()
+        )
+
+    variants = [
+        make_params(),
+        make_params().with_max_segment_length(16).with_split_on_word(True),
+        make_params().with_translate(True),
+    ]
+    context = w.api.Context.from_file(w.utils.download_model("tiny.en"))
+
+    expected = []
+    for params in variants:
+        assert not context.full(params, audio_file)
+        expected.append(context.full_segments())
+    assert len(expected[1]) > len(expected[0])
+
+    results = context.full_multi(variants, audio_file)
+    assert results == expected
+    # the first variant ran on the context's own state
+    assert context.full_segments() == expected[0]
+    assert context.full_multi([], audio_file) == []
+
+
+def test_lang_detect_batch(audio_file: NDArray[np.float32]):
+    import numpy as np
+
+    context = w.api.Context.from_file(w.utils.download_model("tiny.en"))
+    sr = w.api.SAMPLE_RATE
+    clips = [audio_file[: 2 * sr], audio_file[sr : 4 * sr], audio_file[: 3 * sr]]
+
+    probs = context.lang_detect_batch(clips, n_states=2)
+    assert probs.shape == (len(clips), context.lang_max_id + 1)
+    assert np.all(probs >= 0)
+
+    # the full encoder context matches lang_detect clip by clip
+    probs = context.lang_detect_batch(clips, audio_ctx=context.n_audio_ctx)
+    for clip, row in zip(clips, probs):
+        context.pc_to_mel(clip)
+        assert np.allclose(row, context.lang_detect(0), atol=1e-5)
+
+    assert context.lang_detect_batch([]).shape == (0, context.lang_max_id + 1)
+    with pytest.raises(ValueError):
+        context.lang_detect_batch([audio_file[:10]])
+
+
+def test_transcription_cache(
+    params: w.api.Params, audio_file: NDArray[np.float32], tmp_path: p.Path
+):
+    context = w.api.Context.from_file(w.utils.download_model("tiny.en"))
+    assert not context.full(params, audio_file)
+    expected = context.full_segments()
+
+    cache = w.api.TranscriptionCache(path=tmp_path.__fspath__())
+    context.set_transcription_cache(cache)
+    params = params.with_no_context(True)
+    assert not context.full(params, audio_file)
+    assert context.full_segments() == expected
+    assert (cache.hits, cache.misses, cache.size) == (0, 1, 1)
+
+    assert not context.full(params, audio_file)
+    assert context.full_segments() == expected
+    assert cache.hits == 1
+
+    # other audio or params miss
+    translate = (
+        w.api.Params.from_enum(w.api.SAMPLING_GREEDY)
+        .with_print_progress(False)
+        .with_no_context(True)
+        .with_translate(True)
+        .build()
+    )
+    assert not context.full(translate, audio_file)
+    assert not context.full(params, audio_file[: len(audio_file) // 2])
+    assert cache.misses == 3 and cache.size == 3
+
+    # entries on disk outlive the memory tier
+    cache.clear()
+    assert cache.size == 0
+    assert not context.full(params, audio_file)
+    assert context.full_segments() == expected
+    assert cache.hits == 2 and cache.size == 1
+
+    # truncated or corrupt entries on disk are misses, whatever their counts
+    import struct
+
+    for entry in tmp_path.glob("*.bin"):
+        # keep the magic, version and key, claim 2**32 - 1 segments
+        header = entry.read_bytes()[:40]
+        entry.write_bytes(header + struct.pack("=iI", 0, 0xFFFFFFFF))
+    cache.clear()
+    assert not context.full(params, audio_file)
+    assert context.full_segments() == expected
+    assert cache.misses == 4
+
+    context.set_transcription_cache(None)
+    assert context.transcription_cache is None
+
+
+def test_params_snapshot(params: w.api.Params, audio_file: NDArray[np.float32]):
+    import concurrent.futures
+
+    context = w.api.Context.from_file(w.utils.download_model("tiny.en"))
+    assert not context.full(params, audio_file)
+    expected = context.full_segments()
+
+    snapshot = w.api.ParamsSnapshot(params)
+    assert snapshot == w.api.ParamsSnapshot(params)
+    assert hash(snapshot) == hash(w.api.ParamsSnapshot(params))
+
+    # copies of Params are independent, and later changes don't reach the
+    # snapshot
+    other = params.build().with_translate(True)
+    assert not params.translate
+    assert w.api.ParamsSnapshot(other) != snapshot
+    assert w.api.ParamsSnapshot(params) == snapshot
+
+    assert not context.full(snapshot, audio_file)
+    assert context.full_segments() == expected
+
+    scheduler = w.api.PipelineScheduler(context, n_states=2)
+    with concurrent.futures.ThreadPoolExecutor(max_workers=2) as pool:
+        futures = [
+            pool.submit(scheduler.transcribe, params, audio_file) for _ in range(2)
+        ]
+        for future in futures:
+            assert future.result() == expected
+
+
+def test_logits_processor(audio_file: NDArray[np.float32]):
+    def make_params() -> w.api.Params:
+        return (
+            w.api.Params.from_enum(w.api.SAMPLING_GREEDY)
+            .with_print_progress(False)
+            .build()
+        )
+
+    def text_tokens(context: w.api.Context) -> list[int]:
+        return [
+            context.full_get_token_id(i, j)
+            for i in range(context.full_n_segments())
+            for j in range(context.full_n_tokens(i))
+            if context.full_get_token_id(i, j) < context.eot_token
+        ]
+
+    context = w.api.Context.from_file(w.utils.download_model("tiny.en"))
+    assert not context.full(make_params(), audio_file)
+    expected = context.full_segments()
+    tokens = text_tokens(context)
+    assert tokens
+
+    assert not context.full(make_params().with_token_bias({0: 0.0}), audio_file)
+    assert context.full_segments() == expected
+
+    allowed = tokens[::2]
+    assert not context.full(make_params().with_allowed_tokens(allowed), audio_file)
+    assert set(text_tokens(context)) <= set(allowed)
+
+    denied = tokens[: len(tokens) // 2]
+    assert not context.full(make_params().with_denied_tokens(denied), audio_file)
+    assert not set(text_tokens(context)) & set(denied)
+
+    biased = make_params().with_token_bias({t: -100.0 for t in denied})
+    assert not context.full(biased, audio_file)
+    assert not set(text_tokens(context)) & set(denied)
+
+    assert not context.full(make_params().with_max_token_length(2), audio_file)
+    assert all(len(context.token_to_bytes(t)) <= 2 for t in text_tokens(context))
+
+
+def test_hotwords(params: w.api.Params, audio_file: NDArray[np.float32]):
+    context = w.api.Context.from_file(w.utils.download_model("tiny.en"))
+    tokens = context.tokenize(" Zorblax", max_tokens=16)
+    assert 0 < len(tokens) < 16
+
+    assert not context.full(params, audio_file)
+    assert "Zorblax" not in "".join(t for _, _, t in context.full_segments())
+
+    # a boost this large forces the phrase in
+    boosted = params.build().with_hotwords(["Zorblax"], boost=100.0)
+    assert not context.full(boosted, audio_file)
+    assert "Zorblax" in "".join(t for _, _, t in context.full_segments())
+
+
+def test_regex_constraint(params: w.api.Params, audio_file: NDArray[np.float32]):
+    import re
+
+    context = w.api.Context.from_file(w.utils.download_model("tiny.en"))
+    for pattern in ["yes|no", r"\d{1,4}", "[a-z ]+"]:
+        constrained = params.build().with_regex_constraint(pattern)
+        assert not context.full(constrained, audio_file)
+        for _, _, text in context.full_segments():
+            assert re.fullmatch(f" *({pattern})", text), text
+
+    with pytest.raises(ValueError):
+        params.build().with_regex_constraint("(yes|no")
+
+
+def test_no_speech_threshold(
+    params: w.api.Params, audio_file: NDArray[np.float32]
+):
+    import numpy as np
+
+    context = w.api.Context.from_file(w.utils.download_model("tiny.en"))
+    params = params.with_no_context(True)
+    assert params.no_speech_threshold == 1.0
+    assert not context.full(params, audio_file)
+    expected = context.full_segments()
+
+    silence = np.zeros(w.api.SAMPLE_RATE * 5, dtype=np.float32)
+    thold = params.build().with_no_speech_thold(0.5)
+    assert not context.full(thold, silence)
+    assert context.full_n_segments() == 0
+    # speech is transcribed as before
+    assert not context.full(thold, audio_file)
+    assert context.full_segments() == expected
+
+
+def test_speculative_fallback(
+    params: w.api.Params, audio_file: NDArray[np.float32]
+):
+    context = w.api.Context.from_file(w.utils.download_model("tiny.en"))
+    params = params.with_no_context(True)
+    assert params.speculative_fallback == 0
+    assert not context.full(params, audio_file)
+    expected = context.full_segments()
+
+    # decodes without falling back, so the first run wins
+    speculative = params.build().with_speculative_fallback(2)
+    assert speculative.speculative_fallback == 2
+    assert not context.full(speculative, audio_file)
+    assert context.full_segments() == expected
+
+    # every temperature but the last fails
+    failing = params.build().with_logprob_thold(0.0)
+    assert not context.full(failing.with_speculative_fallback(5), audio_file)
+
+
+def test_beam_search_patience(
+    audio_file: NDArray[np.float32], capfd: pytest.CaptureFixture[str]
+):
+    import re
+
+    decode_runs = {}
+    for patience in [0.2, 0.6, 1.0]:
+        context = w.api.Context.from_file(w.utils.download_model("tiny.en"))
+        params = w.api.Params.from_sampling_strategy(
+            w.api.SamplingStrategies.from_strategy_type(
+                w.api.SamplingBeamSearchStrategy()
+                .with_beam_size(5)
+                .with_patience(patience)
+            )
+        ).with_print_progress(False)
+        assert not context.full(params, audio_file)
+        assert context.full_n_segments() > 0
+
+        # whisper.cpp counts every decoder evaluation
+        capfd.readouterr()
+        context.print_timings()
+        match = re.search(r"decode time =.*?(\d+) runs", capfd.readouterr().err)
+        assert match is not None
+        decode_runs[patience] = int(match.group(1))
+
+    # the remaining beams stop once enough of them have finished
+    assert decode_runs[0.2] < decode_runs[1.0]
+
+
+def test_trim_state(audio_file: NDArray[np.float32]):
+    context = w.api.Context.from_file(w.utils.download_model("tiny.en"))
+    params = w.api.Params.from_sampling_strategy(
+        w.api.SamplingStrategies.from_strategy_type(
+            w.api.SamplingBeamSearchStrategy().with_beam_size(5)
+        )
+    ).with_print_progress(False).with_no_context(True)
+    assert not context.full(params, audio_file)
+    expected = context.full_segments()
+
+    assert context.trim_state() > 0
+    assert context.full_segments() == expected
+    assert context.trim_state() == 0
+    # the released buffers are allocated again when needed
+    assert not context.full(params, audio_file)
+    assert context.full_segments() == expected
+
+
+def _to_f32_model(src: str, dst: p.Path) -> str:
+    # Rewrite a ggml whisper model with every f16 tensor in f32: magic, 11
+    # hparams ending with the ftype, mel filters, vocab, then the tensors.
+    import struct
+
+    import numpy as np
+
+    data = p.Path(src).read_bytes()
+    out = bytearray(data[:4])
+    hparams = list(struct.unpack_from("<11i", data, 4))
+    hparams[10] = 0
+    out += struct.pack("<11i", *hparams)
+    off = 4 + 11 * 4
+    n_mel, n_fft = struct.unpack_from("<2i", data, off)
+    off += 8 + 4 * n_mel * n_fft
+    (n_vocab,) = struct.unpack_from("<i", data, off)
+    off += 4
+    for _ in range(n_vocab):
+        (n,) = struct.unpack_from("<I", data, off)
+        off += 4 + n
+    out += data[4 + 11 * 4 : off]
+    while off < len(data):
+        n_dims, n_name, ftype = struct.unpack_from("<3i", data, off)
+        dims = struct.unpack_from(f"<{n_dims}i", data, off + 12)
+        header_end = off + 12 + 4 * n_dims + n_name
+        n_elements = int(np.prod(dims))
+        out += struct.pack("<3i", n_dims, n_name, 0)
+        out += data[off + 12 : header_end]
+        if ftype == 1:
+            weights = np.frombuffer(data, np.float16, n_elements, header_end)
+            out += weights.astype(np.float32).tobytes()
+            off = header_end + 2 * n_elements
+        else:
+            out += data[header_end : header_end + 4 * n_elements]
+            off = header_end + 4 * n_elements
+    dst.write_bytes(bytes(out))
+    return dst.__fspath__()
+
+
+def test_init_state_kv_f16(
+    params: w.api.Params, audio_file: NDArray[np.float32], tmp_path: p.Path
+):
+    import numpy as np
+
+    params = params.with_no_context(True)
+    # NOTE: the K/V caches of an f16 model are f16 already
+    model = _to_f32_model(
+        w.utils.download_model("tiny.en"), tmp_path / "ggml-tiny.en-f32.bin"
+    )
+    context = w.api.Context.from_file(model, True)
+    context.init_state()
+    assert not context.full(params, audio_file)
+    expected = [text for _, _, text in context.full_segments()]
+    context.pc_to_mel(audio_file)
+    context.encode(0)
+    assert all(x.dtype == np.float32 for x in context.get_encoder_output())
+
+    compact = w.api.Context.from_file(model, True)
+    compact.init_state(kv_f16=True)
+    assert not compact.full(params, audio_file)
+    assert [text for _, _, text in compact.full_segments()] == expected
+    compact.pc_to_mel(audio_file)
+    compact.encode(0)
+    assert all(x.dtype == np.float16 for x in compact.get_encoder_output())
+
+    # a shared transcription cache tells the two apart
+    cache = w.api.TranscriptionCache()
+    context.set_transcription_cache(cache)
+    compact.set_transcription_cache(cache)
+    assert not context.full(params, audio_file)
+    assert not compact.full(params, audio_file)
+    assert (cache.hits, cache.misses) == (0, 2)